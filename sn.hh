@@ -4,15 +4,25 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <sstream>
 #include <memory>
 #include <initializer_list>
 #include <unordered_map>
 #include <functional>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <condition_variable>
+#include <type_traits>
 
 #include <string.h>
+#include <stdio.h>
 
 namespace SN {
   class Context;
+  class LoadedLanguage;
   extern const std::string DEFAULT_LANGUAGE; // "en-US"
   bool IsValidLanguageCode(const std::string& code);
   // If there is an obvious code to fall back to, provides that code.
@@ -31,15 +41,75 @@ namespace SN {
   // Fallback header. (This does not affect SimpleFallback's return value,
   // since it is not related to any context.)
   bool SimpleFallback(const std::string& from, std::string& to);
+  // A parsed, canonicalized language code. Tags are interned: all tags for
+  // the same code (ignoring case) share a single parse, so comparing two tags
+  // is a pointer comparison, and each tag's SimpleFallback is only worked out
+  // once. Interned tags live until the program exits.
+  class LanguageTag {
+    struct Data {
+      std::string code; // in canonical case ("zh-Hant-TW")
+      std::string lowercase;
+      // subtag positions within code; script and region have zero length if
+      // absent, and the language includes any extended language subtags
+      uint32_t language_length;
+      uint32_t script_offset, script_length;
+      uint32_t region_offset, region_length;
+      // nullptr if SimpleFallback gives nothing
+      const Data* simple_fallback;
+    };
+    const Data* data;
+    explicit inline LanguageTag(const Data* data) : data(data) {}
+    // the tag table's mutex must be held
+    static const Data* InternLocked(const std::string& lowercase);
+  public:
+    struct Hash {
+      inline size_t operator()(const LanguageTag& tag) const {
+        return std::hash<const void*>()(tag.data);
+      }
+    };
+    // the invalid tag
+    inline LanguageTag() : data(nullptr) {}
+    // returns the invalid tag if code is not valid (see IsValidLanguageCode)
+    static LanguageTag Get(const std::string& code);
+    inline bool IsValid() const { return data != nullptr; }
+    // the following are empty for the invalid tag
+    const std::string& GetCode() const;
+    const std::string& GetLowercase() const;
+    std::string GetLanguage() const;
+    std::string GetScript() const;
+    std::string GetRegion() const;
+    // the tag that SimpleFallback gives, or the invalid tag if none
+    inline LanguageTag GetSimpleFallback() const {
+      return LanguageTag(data ? data->simple_fallback : nullptr);
+    }
+    inline bool operator==(const LanguageTag& other) const {
+      return data == other.data;
+    }
+    inline bool operator!=(const LanguageTag& other) const {
+      return data != other.data;
+    }
+  };
   class CatSource {
   public:
     virtual ~CatSource();
     virtual void GetAvailableCats(std::function<void(std::string)>) = 0;
     virtual std::unique_ptr<std::istream> OpenCat(const std::string& cat) = 0;
+    // Starts reading all of the given cats at once, and returns a future for
+    // each (in the same order) that gives what OpenCat would have. Languages
+    // are loaded by fetching every cat in the fallback chain in one batch,
+    // and parsing each one as soon as it (and the ones before it) arrive.
+    // Whatever is read ahead is held until it's parsed, so it must come to
+    // no more than budget bytes; subtract what it does come to from budget.
+    // (Every source fetches for a load out of the same budget.) The default
+    // fetches nothing ahead of time; it calls OpenCat when each future is
+    // waited on.
+    virtual std::vector<std::future<std::unique_ptr<std::istream> > >
+    FetchCats(const std::vector<std::string>& cats, size_t& budget);
   };
   /* FileCatSource is located in sn_file_cat_source_*.cc */
   class FileCatSource : public CatSource {
     std::string dirpath_plus_prefix, dirpath, prefix, suffix;
+    std::string GetPath(const std::string& cat) const;
   public:
     // The basepath will normally end with a directory separator. If it does
     // not, the last path component will end up being a filename prefix.
@@ -48,6 +118,11 @@ namespace SN {
     virtual ~FileCatSource();
     void GetAvailableCats(std::function<void(std::string)>) override;
     std::unique_ptr<std::istream> OpenCat(const std::string& cat) override;
+    // Reads the cats whole, through io_uring where the kernel has it, or
+    // else on a few threads. (Very big cats are left to OpenCat, so that
+    // they can be read a piece at a time.)
+    std::vector<std::future<std::unique_ptr<std::istream> > >
+    FetchCats(const std::vector<std::string>& cats, size_t& budget) override;
   };
   class Key {
   protected:
@@ -70,6 +145,14 @@ namespace SN {
         // more digits are used as a scrambler
         + (static_cast<uint32_t>(*(end-1)) * 0x85A308D3U);
     }
+    // The hash of a name that has had len more chars appended to it, given
+    // the hash of the name before
+    static inline constexpr
+    uint32_t ExtendHash(uint32_t hash, const char* p, size_t len) {
+      for(size_t n = 0; n < len; ++n)
+        hash = rol(hash, 5) + static_cast<uint32_t>(p[n]) * 0x85A308D3U;
+      return hash;
+    }
     inline const char* GetNamePointer() const { return name; }
     inline size_t GetNameLength() const { return name_len; }
     inline uint32_t GetHashCode() const { return hash_code; }
@@ -101,50 +184,317 @@ namespace SN {
       this->name = name;
     }
   };
-  // Owns and copies its string
+  // Owns and copies its string. Names that fit in INLINE_CAPACITY are kept
+  // inside the key itself, so making one doesn't allocate.
+  // Pieces can be appended, extending the hash as they go, so building a key
+  // from a _Key prefix never hashes the prefix again:
+  //   SN::DynamicKey key("SIZEOF_INT_"_Key);
+  //   key.Append(sizeof(int));
   class DynamicKey : public Key {
-    static const char* clone_region(const char* src, size_t len) {
-      char* ret = new char[len];
-      memcpy(ret, src, len);
-      return ret;
+  public:
+    static const size_t INLINE_CAPACITY = 32;
+  private:
+    size_t capacity;
+    char inline_name[INLINE_CAPACITY];
+    inline char* GetBuffer() { return const_cast<char*>(name); }
+    inline void Release() {
+      if(name != inline_name) delete[] name;
     }
-    void DisownName() { name = nullptr; }
+    // moves the name to a bigger heap buffer, and appends piece to it
+    void GrowAndAppend(const char* piece, size_t len);
+    inline void Assign(const char* src, size_t len, uint32_t hash_code) {
+      if(len > capacity) {
+        // (src might be our own name, so don't free it yet)
+        char* buffer = new char[len];
+        memcpy(buffer, src, len);
+        Release();
+        name = buffer;
+        capacity = len;
+      }
+      else memmove(GetBuffer(), src, len);
+      name_len = len;
+      this->hash_code = hash_code;
+    }
+    DynamicKey& AppendInteger(unsigned long long magnitude, bool negative);
   public:
+    inline DynamicKey()
+      : Key(inline_name, 0, CalculateHash(inline_name, inline_name)),
+        capacity(INLINE_CAPACITY) {}
     inline DynamicKey(const char* key, size_t len)
       : DynamicKey(key, len, CalculateHash(key, key+len)) {}
     inline DynamicKey(const char* key, size_t len, uint32_t hash_code)
-      : Key(clone_region(key, len), len, hash_code) {}
+      : Key(inline_name, 0, hash_code), capacity(INLINE_CAPACITY) {
+      Assign(key, len, hash_code);
+    }
     inline DynamicKey(const Key& other)
       : DynamicKey(other.GetNamePointer(), other.GetNameLength(),
                    other.GetHashCode()) {}
+    inline DynamicKey(const DynamicKey& other)
+      : DynamicKey(static_cast<const Key&>(other)) {}
     inline DynamicKey(DynamicKey&& other)
-      : Key(other.GetNamePointer(), other.GetNameLength(), other.GetHashCode())
-    { other.DisownName(); }
-    inline ~DynamicKey() { if(name != nullptr) delete[] name; }
+      : Key(inline_name, 0, other.GetHashCode()), capacity(INLINE_CAPACITY) {
+      *this = std::move(other);
+    }
+    inline ~DynamicKey() { Release(); }
     inline DynamicKey& operator=(const Key& other) {
-      if(name != nullptr) delete[] name;
-      name = clone_region(other.GetNamePointer(), other.GetNameLength());
-      name_len = other.GetNameLength();
-      hash_code = other.GetHashCode();
+      Assign(other.GetNamePointer(), other.GetNameLength(),
+             other.GetHashCode());
       return *this;
     }
+    inline DynamicKey& operator=(const DynamicKey& other) {
+      return *this = static_cast<const Key&>(other);
+    }
     inline DynamicKey& operator=(DynamicKey&& other) {
-      if(name != nullptr) delete[] name;
-      name = other.GetNamePointer();
-      name_len = other.GetNameLength();
-      hash_code = other.GetHashCode();
-      other.DisownName();
+      if(&other == this) return *this;
+      if(other.name == other.inline_name)
+        Assign(other.name, other.name_len, other.hash_code);
+      else {
+        Release();
+        name = other.name;
+        name_len = other.name_len;
+        hash_code = other.hash_code;
+        capacity = other.capacity;
+      }
+      other.name = other.inline_name;
+      other.name_len = 0;
+      other.hash_code = CalculateHash(other.inline_name, other.inline_name);
+      other.capacity = INLINE_CAPACITY;
+      return *this;
+    }
+    inline DynamicKey& Append(const char* piece, size_t len) {
+      hash_code = ExtendHash(hash_code, piece, len);
+      if(name_len + len > capacity) GrowAndAppend(piece, len);
+      else memcpy(GetBuffer() + name_len, piece, len);
+      name_len += len;
       return *this;
     }
+    inline DynamicKey& Append(const std::string& piece) {
+      return Append(piece.data(), piece.length());
+    }
+    inline DynamicKey& Append(const Key& piece) {
+      return Append(piece.GetNamePointer(), piece.GetNameLength());
+    }
+    inline DynamicKey& Append(char c) { return Append(&c, 1); }
+    // Appends an integer, in decimal
+    template<class T, typename std::enable_if<std::is_integral<T>::value
+                                              && std::is_signed<T>::value
+                                              && !std::is_same<T, char>::value,
+                                              int>::type = 0>
+    inline DynamicKey& Append(T value) {
+      return value < 0
+        ? AppendInteger(0ULL - static_cast<unsigned long long>(value), true)
+        : AppendInteger(static_cast<unsigned long long>(value), false);
+    }
+    template<class T, typename std::enable_if<std::is_integral<T>::value
+                                              && std::is_unsigned<T>::value
+                                              && !std::is_same<T, char>::value
+                                              && !std::is_same<T, bool>::value,
+                                              int>::type = 0>
+    inline DynamicKey& Append(T value) {
+      return AppendInteger(value, false);
+    }
+  };
+  // A Sink is anything SN can render text into. SN's rendering functions are
+  // templates that work with any class providing these two members:
+  //   void Write(const char* data, size_t length);
+  //   void Put(char c);
+  // The sinks below cover the common cases.
+  class OstreamSink {
+    std::ostream& out;
+  public:
+    inline OstreamSink(std::ostream& out) : out(out) {}
+    inline void Write(const char* data, size_t length) {
+      out.write(data, length);
+    }
+    inline void Put(char c) { out.put(c); }
+  };
+  // Appends to a std::string.
+  class StringSink {
+    std::string& out;
+  public:
+    inline StringSink(std::string& out) : out(out) {}
+    inline void Write(const char* data, size_t length) {
+      out.append(data, length);
+    }
+    inline void Put(char c) { out.push_back(c); }
+  };
+  // Fills a fixed-size buffer, and never writes past its end. If the output
+  // didn't fit, Overflowed returns true, and GetLength returns how much room
+  // it would have needed. Does not NUL-terminate.
+  class BufferSink {
+    char* buffer;
+    size_t size, length;
+  public:
+    inline BufferSink(char* buffer, size_t size)
+      : buffer(buffer), size(size), length(0) {}
+    inline void Write(const char* data, size_t length) {
+      if(this->length < size)
+        memcpy(buffer + this->length, data,
+               length < size - this->length ? length : size - this->length);
+      this->length += length;
+    }
+    inline void Put(char c) {
+      if(length < size) buffer[length] = c;
+      ++length;
+    }
+    inline size_t GetLength() const { return length; }
+    inline bool Overflowed() const { return length > size; }
+  };
+  // Writes to a stdio FILE.
+  class FileSink {
+    FILE* f;
+  public:
+    inline FileSink(FILE* f) : f(f) {}
+    inline void Write(const char* data, size_t length) {
+      fwrite(data, 1, length, f);
+    }
+    inline void Put(char c) { putc(c, f); }
+  };
+  /* FdSink's non-inline parts are located in sn_fd_sink_posix.cc */
+  // Writes to a raw file descriptor, through its own buffer. The buffer is
+  // flushed when it fills, when Flush is called, and on destruction.
+  class FdSink {
+    int fd;
+    bool failed;
+    size_t used;
+    char buffer[4096];
+    void WriteDirect(const char* data, size_t length);
+  public:
+    FdSink(int fd);
+    ~FdSink();
+    FdSink(const FdSink&) = delete;
+    FdSink& operator=(const FdSink&) = delete;
+    inline void Write(const char* data, size_t length) {
+      if(length > sizeof(buffer) - used) {
+        Flush();
+        if(length >= sizeof(buffer)) {
+          WriteDirect(data, length);
+          return;
+        }
+      }
+      memcpy(buffer + used, data, length);
+      used += length;
+    }
+    inline void Put(char c) {
+      if(used == sizeof(buffer)) Flush();
+      buffer[used++] = c;
+    }
+    // Returns false if any write to the descriptor has failed.
+    bool Flush();
+    inline bool Failed() const { return failed; }
+  };
+  // One piece of rendered text. (Same members as a POSIX struct iovec, so
+  // converting for writev is a straight copy.)
+  struct Segment {
+    const char* data;
+    size_t length;
+  };
+  // Doesn't copy anything. Instead, fills a caller-provided array with
+  // segments pointing straight at the message text, the arguments, and any
+  // nested messages, in order. Adjacent segments are merged. If they didn't
+  // all fit, Overflowed returns true, and GetCount returns how many it would
+  // have needed.
+  // When rendered with Context::Render, the language the segments point into
+  // is kept alive (even across language changes) until the sink is
+  // destroyed or cleared. The arguments must stay alive that long too.
+  class SegmentSink {
+    friend class Context;
+    Segment* segments;
+    size_t capacity, count, length;
+    // where the last segment ends, for merging
+    const char* last_end;
+    std::vector<std::shared_ptr<const LoadedLanguage> > languages;
+    // the $1 of every missing key message we rendered
+    std::list<std::vector<std::string> > missing_key_args;
+    // one of each char, for Put
+    static const char CHARACTERS[256];
+  public:
+    inline SegmentSink(Segment* segments, size_t capacity)
+      : segments(segments), capacity(capacity), count(0), length(0),
+        last_end(nullptr) {}
+    inline void Write(const char* data, size_t length) {
+      if(length == 0) return;
+      if(data == last_end && count != 0) {
+        if(count <= capacity) segments[count-1].length += length;
+      }
+      else {
+        if(count < capacity) {
+          segments[count].data = data;
+          segments[count].length = length;
+        }
+        ++count;
+      }
+      last_end = data + length;
+      this->length += length;
+    }
+    inline void Put(char c) {
+      Write(CHARACTERS + static_cast<unsigned char>(c), 1);
+    }
+    inline size_t GetCount() const { return count; }
+    // total length of all the segments
+    inline size_t GetLength() const { return length; }
+    inline bool Overflowed() const { return count > capacity; }
+    // forgets all the segments, so the array can be reused
+    void Clear();
   };
   class SubstitutableString {
-    std::string storage;
-    std::vector<int32_t> code;
+    friend class LoadedLanguage;
+    friend class Context;
+    // (test/sn_compile_test.cc, which checks the compiled code and text)
+    friend struct CompileTest;
+    // The compiled code (code_len int32_ts) followed by the text (storage_len
+    // chars) make up a single block. Usually the SubstitutableString owns
+    // that block. A "packed" one (see Context::SetCompactStorage) instead
+    // lives in its language's arena and finds its block `offset` bytes away
+    // from itself, which keeps the arena position-independent.
+    // Owned blocks are reference counted, so copies (and identical messages,
+    // see LoadedLanguage::Build) share a single block.
+    char* owned; // nullptr if packed
+    int32_t offset;
+    uint32_t code_len;
+    uint32_t storage_len;
+    // makes a packed string whose block is already at block, which must be
+    // 4-byte aligned
+    SubstitutableString(uint32_t code_len, uint32_t storage_len, char* block);
+    void Adopt(SubstitutableString&& other);
+    // owned blocks are preceded by their reference count
+    static char* AllocateBlock(size_t size);
+    static void ReleaseBlock(char* block);
+    inline bool SameBlock(const SubstitutableString& other) const {
+      return code_len == other.code_len && storage_len == other.storage_len
+        && (GetBlockSize() == 0
+            || !memcmp(GetBlock(), other.GetBlock(), GetBlockSize()));
+    }
+    inline const char* GetBlock() const {
+      return owned ? owned : reinterpret_cast<const char*>(this) + offset;
+    }
+    inline size_t GetBlockSize() const {
+      return code_len * sizeof(int32_t) + storage_len;
+    }
+    inline const int32_t* GetCode() const {
+      return reinterpret_cast<const int32_t*>(GetBlock());
+    }
+    inline const char* GetStorage() const {
+      return GetBlock() + code_len * sizeof(int32_t);
+    }
+    // lang is the language nested $(KEY)s are looked up in
+    template<class Sink>
+    void Render(Context& ctx, const LoadedLanguage& lang, Sink& sink,
+                const std::vector<std::string>& args) const;
   public:
     SubstitutableString();
     SubstitutableString(const std::string& raw);
+    SubstitutableString(const SubstitutableString& other);
+    SubstitutableString(SubstitutableString&& other);
+    ~SubstitutableString();
+    SubstitutableString& operator=(const SubstitutableString& other);
+    SubstitutableString& operator=(SubstitutableString&& other);
     void operator()(Context& ctx, std::ostream& out,
                     const std::vector<std::string>&) const;
+    // Renders into any Sink (see above)
+    template<class Sink>
+    void Render(Context& ctx, Sink& sink,
+                const std::vector<std::string>& args) const;
   };
 }
 namespace std {
@@ -164,38 +514,289 @@ namespace std {
   };
 }
 namespace SN {
+  // Remembers where a key's message was found, so that rendering the same key
+  // over and over can skip the hash lookup. It is looked up again, once,
+  // whenever the language changes. A handle can be shared between threads,
+  // and used with any Context. Like ConstKey, it does not own the key's
+  // string.
+  class MessageHandle {
+    friend class LoadedLanguage;
+    ConstKey key;
+    // (generation << 32) | message index, or 0 if never resolved
+    mutable std::atomic<uint64_t> resolved;
+  public:
+    inline explicit MessageHandle(const Key& key)
+      : key(key.GetNamePointer(), key.GetNameLength(), key.GetHashCode()),
+        resolved(0) {}
+    inline MessageHandle(const MessageHandle& other)
+      : key(other.key),
+        resolved(other.resolved.load(std::memory_order_relaxed)) {}
+    inline const Key& GetKey() const { return key; }
+  };
+  // How much memory a language is using, in bytes. See
+  // Context::GetMemoryUsage.
+  struct MemoryUsage {
+    // key names
+    size_t keys = 0;
+    // message text
+    size_t text = 0;
+    // compiled substitution code for messages that have substitutions
+    size_t code = 0;
+    // the key table, per-message bookkeeping, and padding
+    size_t tables = 0;
+    // everything above, for languages kept by the language cache
+    size_t cached = 0;
+    // text and code that weren't stored again, because an identical message
+    // already had them (not part of Total)
+    size_t deduplicated = 0;
+    inline size_t Total() const { return keys + text + code + tables; }
+  };
+  // Every message for one language, with everything it falls back on already
+  // merged in. Built by Context::SetLanguage, and kept around after switching
+  // away if the language cache has room for it.
+  class LoadedLanguage {
+    friend class Context;
+    friend class SubstitutableString;
+    // One slot of an open-addressed (linear probing) key table
+    struct Slot {
+      uint32_t hash;
+      uint32_t message; // index into messages, NO_MESSAGE if empty
+      uint32_t key_offset; // into keys
+      uint32_t key_length;
+    };
+    LanguageTag code;
+    // the Context's source_generation when this was loaded
+    uint32_t source_generation;
+    // unique across all LoadedLanguages in all Contexts
+    uint32_t generation;
+    // Messages, hot table, table and keys, in that order, all live in the
+    // arena. In compact mode, so do the messages' blocks. (So do the hot
+    // messages' blocks, in any mode.)
+    std::unique_ptr<uint64_t[]> arena;
+    size_t arena_size;
+    // true if built compact (and therefore position-independent)
+    bool packed;
+    // For a language attached from shared memory (see
+    // Context::AttachSharedLanguage), keeps the mapping that holds its arena
+    // alive. arena is empty in that case.
+    std::shared_ptr<const void> external;
+    SubstitutableString* messages;
+    uint32_t message_count;
+    const Slot* table;
+    // the table has 1<<(32-table_shift) slots
+    unsigned int table_shift;
+    // A small table of just the hot keys (see Context::LoadKeyProfile),
+    // searched before the main one. nullptr if there are none.
+    const Slot* hot_table;
+    unsigned int hot_table_shift;
+    const char* keys;
+    MemoryUsage memory_usage;
+    // (defined in sn_core.cc)
+    class LazyGroups;
+    // the messages that were left to be loaded on demand (see
+    // Context::SetKeyFilter), or nullptr if none were
+    std::unique_ptr<LazyGroups> lazy;
+    // one per message, allocated the first time key profiling is turned on
+    std::unique_ptr<std::atomic<uint32_t>[]> hit_counts;
+    // hit_counts while key profiling is on, nullptr otherwise
+    std::atomic<std::atomic<uint32_t>*> counting;
+    LoadedLanguage(const LoadedLanguage&) = delete;
+    LoadedLanguage& operator=(const LoadedLanguage&) = delete;
+    // Empties intermap, freeing each entry as soon as it has been copied in.
+    // Identical messages share one block. Unless compact, they also share with
+    // messages in the donors (other languages that are still in memory).
+    // Messages named in hot_keys come first, most used first, along with
+    // their keys and blocks.
+    void Build(std::unordered_map<std::string, SubstitutableString>& intermap,
+               bool compact,
+               const std::vector<const LoadedLanguage*>& donors,
+               const std::vector<std::string>& hot_keys);
+    // true if this has any messages, even if they're all lazy
+    inline bool HasMessages() const {
+      return message_count != 0 || lazy != nullptr;
+    }
+    // searches one table; returns NO_MESSAGE if the key isn't in it
+    uint32_t Probe(const Slot* table, unsigned int shift,
+                   const Key& key) const;
+    inline void CountHit(uint32_t index) const {
+      auto counts = counting.load(std::memory_order_acquire);
+      if(counts) counts[index].fetch_add(1, std::memory_order_relaxed);
+    }
+    // returns NO_MESSAGE if the key is missing
+    uint32_t FindIndex(const Key& key) const;
+    // returns nullptr if the key is missing
+    const SubstitutableString* Find(const Key& key) const;
+    const SubstitutableString* Find(const MessageHandle& handle) const;
+    // see Context::LookupMany (K is ConstKey or DynamicKey; defined, and
+    // only used, in sn_core.cc)
+    template<class K>
+    void FindMany(const K* keys, size_t count,
+                  const SubstitutableString** out) const;
+  public:
+    LoadedLanguage(LanguageTag code = LanguageTag(),
+                   uint32_t source_generation = 0);
+    ~LoadedLanguage();
+  };
   class LangInfo {
     friend class Context;
+    LanguageTag tag;
     std::string code;
     bool data_loaded;
     std::string native_name;
     std::string english_name;
-    std::string fallback;
+    LanguageTag fallback;
   public:
-    inline LangInfo(std::string code)
-      : code(code), data_loaded(false) {}
-    // code in standard case
+    inline LangInfo(LanguageTag tag, std::string code)
+      : tag(tag), code(code), data_loaded(false) {}
+    inline LanguageTag GetTag() { return tag; }
+    // code in the case the CatSource gave it
     inline const std::string& GetCode() { return code; }
     // the following may be empty if no cat provided a value for them
     // language name in this language
     inline const std::string& GetNativeName() { return native_name; }
     // language name in English
     inline const std::string& GetEnglishName() { return english_name; }
-    // language to fall back missing keys to
-    inline const std::string& GetFallback() { return fallback; }
+    // language to fall back missing keys to (the invalid tag if none)
+    inline LanguageTag GetFallback() { return fallback; }
   };
   class Context {
+    friend class SubstitutableString;
     std::ostream& log;
-    std::vector<std::unique_ptr<CatSource> > cat_sources;
-    std::unordered_map<ConstKey, SubstitutableString> loaded_keys;
+    // Held while writing to log. Renders (missing keys) and loads (warnings)
+    // can log from different threads at once.
+    std::mutex log_mutex;
+    // Collects one message, and writes it to log all at once when destroyed.
+    // Use this, and never log directly.
+    class LogMessage {
+      Context& context;
+      std::ostringstream message;
+    public:
+      explicit LogMessage(Context& context) : context(context) {}
+      LogMessage(const LogMessage&) = delete;
+      LogMessage& operator=(const LogMessage&) = delete;
+      ~LogMessage() {
+        std::lock_guard<std::mutex> lock(context.log_mutex);
+        context.log << message.str() << std::flush;
+      }
+      template<class T> LogMessage& operator<<(const T& value) {
+        message << value;
+        return *this;
+      }
+      LogMessage& operator<<(std::ostream& (*manipulator)(std::ostream&)) {
+        message << manipulator;
+        return *this;
+      }
+    };
+    // Held while loading or switching languages, and while touching anything
+    // that loading uses (the CatSources, langinfo, the language cache...)
+    mutable std::mutex load_mutex;
+    // (shared, so that languages with lazy groups can keep reading them)
+    std::vector<std::shared_ptr<CatSource> > cat_sources;
+    // (only changed by SwitchLanguage, with std::atomic_exchange)
+    std::shared_ptr<LoadedLanguage> current;
+    // current.get(), for rendering threads, which don't take load_mutex
+    std::atomic<LoadedLanguage*> live;
+    // Every render registers itself in one of these counters (picked by
+    // thread, to avoid contention), for the epoch it started in. Switching
+    // languages flips the epoch and waits for the old epoch's counters to
+    // drain before freeing the old language.
+    struct ReaderStripe {
+      std::atomic<uint32_t> count[2];
+      char padding[64 - 2 * sizeof(std::atomic<uint32_t>)];
+    };
+    static const unsigned int READER_STRIPES = 16;
+    mutable ReaderStripe reader_stripes[READER_STRIPES];
+    mutable std::atomic<unsigned int> reader_epoch;
+    // Keeps live from being freed while it is in use
+    class Reader {
+      std::atomic<uint32_t>* count;
+    public:
+      const LoadedLanguage* lang;
+      Reader(const Context& ctx);
+      inline ~Reader() { count->fetch_sub(1, std::memory_order_release); }
+    };
+    // incremented by every SetLanguage and SetLanguageAsync; a background
+    // load that sees it change gives up
+    std::atomic<uint32_t> language_request_serial;
+    // the background loading thread, and the request it should handle next
+    std::thread loader_thread;
+    std::mutex loader_mutex;
+    std::condition_variable loader_cond;
+    bool loader_stopping, loader_has_request;
+    LanguageTag loader_request;
+    uint32_t loader_request_serial;
+    std::promise<bool> loader_request_promise;
+    // most recently used first; does not include current
+    std::list<std::shared_ptr<LoadedLanguage> > language_cache;
+    size_t language_cache_budget;
+    bool compact_storage;
+    // see SetKeyFilter
+    std::vector<std::string> key_filter;
+    bool lazy_groups;
+    // changes whenever the list of CatSources does, or any setting that
+    // changes how languages are built (so cached languages don't match)
+    uint32_t source_generation;
     bool langinfo_dirty;
-    std::unordered_map<std::string, LangInfo> langinfo;
-    const char* key_internment;
+    std::unordered_map<LanguageTag, LangInfo, LanguageTag::Hash> langinfo;
+    // (defined in sn_negotiate_language.cc)
+    class NegotiationTable;
+    // built from langinfo when first needed, and thrown away whenever the
+    // CatSources change. Old tables are kept until the Context is destroyed,
+    // since a Negotiate call might still be using them.
+    std::atomic<const NegotiationTable*> negotiation_table;
+    std::vector<std::shared_ptr<const NegotiationTable> > negotiation_tables;
+    // what AttachSharedLanguage last attached (version 0 if nothing)
+    std::string shared_language_name;
+    uint64_t shared_language_version;
+    bool key_profiling;
+    // from LoadKeyProfile, most used first
+    std::vector<std::string> hot_keys;
+    void StartCounting(LoadedLanguage& lang);
+    void TrimLanguageCache();
+    // (load_mutex must be held for all of these)
+    // Returns the cached language for this code, if any, removing it from
+    // the cache
+    std::shared_ptr<LoadedLanguage> TakeCachedLanguage(LanguageTag language);
+    // returns nullptr if serial is nonzero and gets superseded
+    std::shared_ptr<LoadedLanguage> BuildLanguage(LanguageTag language,
+                                                  uint32_t serial);
+    // makes next the current language, and caches or frees the old one
+    void SwitchLanguage(std::shared_ptr<LoadedLanguage> next);
+    bool Superseded(uint32_t serial) const;
+    void LoaderThreadMain();
     void MaybeGetLanguageList();
-    void LoadLanguage(const std::string& language,
-                      std::unordered_map<std::string, SubstitutableString>&);
-    bool AcceptableLanguage(const std::string& language);
+    // lazy is nullptr unless lazy_groups is set
+    void LoadLanguage(LanguageTag language,
+                      std::unordered_map<std::string, SubstitutableString>&,
+                      uint32_t serial, LoadedLanguage::LazyGroups* lazy);
+    // Appends the LangInfo of language, and of everything it falls back to,
+    // to chain, fallbacks first
+    void GetFallbackChain(LanguageTag language, std::vector<LangInfo*>& chain,
+                          uint32_t serial);
+    // Parses one of info's cats into intermap
+    void LoadCat(LangInfo& info, const std::shared_ptr<CatSource>& src,
+                 std::istream& f,
+                 std::unordered_map<std::string, SubstitutableString>&,
+                 uint32_t serial, LoadedLanguage::LazyGroups* lazy);
+    bool AcceptableLanguage(LanguageTag language);
+    // Logs the missing key, and returns what to render in its place (with the
+    // key as $1)
+    const SubstitutableString& GetMissingKeyMessage(const LoadedLanguage& lang,
+                                                    const Key& key);
+    // p is the result of looking key up in lang
+    template<class Sink>
+    void RenderLookedUp(const LoadedLanguage& lang, Sink& sink,
+                        const Key& key, const SubstitutableString* p,
+                        const std::vector<std::string>& args);
+    // (the missing key message's argument has to outlive the render)
+    void RenderLookedUp(const LoadedLanguage& lang, SegmentSink& sink,
+                        const Key& key, const SubstitutableString* p,
+                        const std::vector<std::string>& args);
     void MaybeLoadLangInfo(LangInfo& info);
+    // (both GetManys; defined in sn_core.cc)
+    template<class K>
+    void GetManyOf(const K* keys, size_t count, std::string* out,
+                   const std::vector<std::string>* args);
   public:
     Context(std::ostream& log = std::cerr);
     ~Context();
@@ -217,15 +818,125 @@ namespace SN {
     // will be used.)
     std::string GetSystemLanguage(const std::string& default_choice
                                   = DEFAULT_LANGUAGE);
+    // (Negotiate is located in sn_negotiate_language.cc)
+    // Picks the best available language for an HTTP Accept-Language header,
+    // such as "fr-CH, fr;q=0.9, en;q=0.8, *;q=0.5". Language ranges are tried
+    // in order of their q values. A range matches if there are cats for it,
+    // or for a language it falls back to ("es-PA" matches "es"), or if it is
+    // what an available language would fall back to ("es" matches "es-ES",
+    // if there is no plain "es"). Returns the code of the matching available
+    // language, or default_choice if nothing matched.
+    // Does not allocate memory in the common case, and may be called from
+    // many threads at once.
+    std::string Negotiate(const char* header, size_t length,
+                          const std::string& default_choice
+                          = DEFAULT_LANGUAGE);
+    inline std::string Negotiate(const std::string& header,
+                                 const std::string& default_choice
+                                 = DEFAULT_LANGUAGE) {
+      return Negotiate(header.data(), header.length(), default_choice);
+    }
     // clears all loaded data, sets the current language, and loads every
     // relevant cat for that language
     // if you don't call this, cats won't be loaded!
     Context& SetLanguage(const std::string& language = DEFAULT_LANGUAGE);
-    // Returns true if at least one message was successfully loaded.
-    operator bool() const { return !loaded_keys.empty(); }
+    // Like SetLanguage, but does the loading on a background thread. The
+    // current language stays in use until the new one is ready, and then
+    // they are switched atomically; it is safe to Get and Out from other
+    // threads throughout. If SetLanguage or SetLanguageAsync is called again
+    // before this load finishes, it is abandoned and the future yields false.
+    // Otherwise, the future yields true once the new language is current.
+    std::future<bool> SetLanguageAsync(const std::string& language
+                                       = DEFAULT_LANGUAGE);
+    // When SetLanguage switches away from a language, it can keep that
+    // language's messages around, so that switching back later doesn't have
+    // to reload them. This sets how many bytes of memory those languages may
+    // use altogether (not counting the current language). The default is
+    // zero, which means every SetLanguage reloads from scratch.
+    // The cache is emptied whenever CatSources are added or cleared.
+    Context& SetLanguageCacheBudget(size_t bytes);
+    // Forgets every language kept by the language cache. Useful if your cats
+    // have changed and you want the next SetLanguage to see the changes.
+    Context& FlushLanguageCache();
+    // In compact storage mode, languages loaded by subsequent calls to
+    // SetLanguage pack all of their message text and code into one flat
+    // allocation with their key table, instead of giving every message its
+    // own heap block. This saves memory (especially for lots of short
+    // messages) at the cost of one extra copy while loading. Off by default.
+    // Empties the language cache.
+    Context& SetCompactStorage(bool compact);
+    // Languages loaded by subsequent calls to SetLanguage only keep messages
+    // whose keys start with one of the given prefixes (and __MISSING_KEY__).
+    // The bodies of all the other messages are skipped without being
+    // compiled or stored.
+    // If lazy is true, those messages aren't thrown away, but divided into
+    // groups by their keys' prefix up to the first underscore ("MAIL_" for
+    // "MAIL_SUBJECT"), with all the keys that have no underscore in one group
+    // of their own. The first lookup of a key in a group loads the whole
+    // group, rereading just its messages from the CatSources. (So they must
+    // not change underneath a loaded language, and their OpenCat must be
+    // safe to call from any thread.)
+    // An empty list of prefixes with lazy false (the default) keeps
+    // everything. Empties the language cache.
+    Context& SetKeyFilter(const std::vector<std::string>& prefixes,
+                          bool lazy = false);
+    // Reports how much memory the current language, and the language cache,
+    // are using.
+    MemoryUsage GetMemoryUsage() const;
+    // While key profiling is on, every lookup in the current language is
+    // counted, at the cost of an atomic increment per lookup. Off by default.
+    Context& SetKeyProfiling(bool profiling);
+    // Writes out which keys of the current language have been looked up
+    // while key profiling was on, most used first, in the form that
+    // LoadKeyProfile reads.
+    void WriteKeyProfile(std::ostream& out) const;
+    // Reads a profile written by WriteKeyProfile. Languages loaded after
+    // this keep the (up to max_hot_keys) most used keys, their messages, and
+    // the messages' text and code together at the front of their storage,
+    // with a small key table of their own that is searched first, so that
+    // the memory most lookups touch fits in cache. An empty profile turns
+    // this off again. Empties the language cache.
+    Context& LoadKeyProfile(std::istream& profile, size_t max_hot_keys = 1024);
+    // (PublishSharedLanguage and AttachSharedLanguage are located in
+    // sn_shared_language_posix.cc)
+    // Copies the current language into a POSIX shared memory segment, where
+    // other processes (such as pre-forked workers) can attach to it with
+    // AttachSharedLanguage, without loading any cats or making their own
+    // copy. name is a shm_open name, such as "/myapp-language". Every call
+    // publishes a new version under that name and retires the previous one.
+    // Only one process should publish under any given name. A language with
+    // lazy key groups (see SetKeyFilter) can't be published. Returns false,
+    // and logs why, on failure.
+    bool PublishSharedLanguage(const std::string& name);
+    // Makes the newest version published under name the current language,
+    // mapping it read-only instead of loading it. Does nothing if that
+    // version is already current, so it's cheap to call again whenever you
+    // want to pick up a new version. The publisher must be the same build of
+    // the same program. Returns false, and logs why, on failure, in which
+    // case the current language is unchanged.
+    bool AttachSharedLanguage(const std::string& name);
+    // Returns true if at least one message was successfully loaded (or left
+    // to be loaded on demand; see SetKeyFilter).
+    operator bool() const {
+      Reader reader(*this);
+      return reader.lang->HasMessages();
+    }
     // Returns the SubstitutableString for the given key. You probably don't
     // want this. You probably want Get.
+    // The result is only valid until the language changes. (Get, Out and
+    // Render don't have this problem.)
     const SubstitutableString* Lookup(const Key& key);
+    // As above, but reuses the handle's previous result if the language
+    // hasn't changed since.
+    const SubstitutableString* Lookup(const MessageHandle& handle);
+    // Looks up count keys at once, storing what Lookup would have returned
+    // for keys[n] into out[n]. Every key's bucket is fetched before any key
+    // is compared, so the cache misses overlap instead of being paid one
+    // key at a time. Worthwhile when you know many keys in advance.
+    void LookupMany(const ConstKey* keys, size_t count,
+                    const SubstitutableString** out);
+    void LookupMany(const DynamicKey* keys, size_t count,
+                    const SubstitutableString** out);
     // Returns the translated string for a given key, with the given positional
     // arguments.
     std::string Get(const Key& key,
@@ -236,7 +947,101 @@ namespace SN {
              std::initializer_list<std::string> args = {});
     void Out(std::ostream& out, const Key& key,
              const std::vector<std::string>& args);
+    // The same, using a MessageHandle.
+    std::string Get(const MessageHandle& handle,
+                    std::initializer_list<std::string> args = {});
+    std::string Get(const MessageHandle& handle,
+                    const std::vector<std::string>& args);
+    void Out(std::ostream& out, const MessageHandle& handle,
+             std::initializer_list<std::string> args = {});
+    void Out(std::ostream& out, const MessageHandle& handle,
+             const std::vector<std::string>& args);
+    // Renders the translated string into any Sink (see above), such as a
+    // StringSink or an FdSink. Get and Out are wrappers around these.
+    template<class Sink>
+    void Render(Sink& sink, const Key& key,
+                const std::vector<std::string>& args = {}) {
+      Reader reader(*this);
+      RenderLookedUp(*reader.lang, sink, key, reader.lang->Find(key), args);
+    }
+    template<class Sink>
+    void Render(Sink& sink, const MessageHandle& handle,
+                const std::vector<std::string>& args = {}) {
+      Reader reader(*this);
+      RenderLookedUp(*reader.lang, sink, handle.GetKey(),
+                     reader.lang->Find(handle), args);
+    }
+    // The same, but rendering into a SegmentSink, which keeps the current
+    // language alive for as long as its segments point into it. Useful for
+    // handing the text to writev without copying it.
+    void Render(SegmentSink& sink, const Key& key,
+                const std::vector<std::string>& args = {});
+    void Render(SegmentSink& sink, const MessageHandle& handle,
+                const std::vector<std::string>& args = {});
+    // Translates count keys at once (see LookupMany), storing the result for
+    // keys[n] into out[n]. If args is not null, args[n] gives the positional
+    // arguments for keys[n].
+    void GetMany(const ConstKey* keys, size_t count, std::string* out,
+                 const std::vector<std::string>* args = nullptr);
+    void GetMany(const DynamicKey* keys, size_t count, std::string* out,
+                 const std::vector<std::string>* args = nullptr);
   };
+  template<class Sink>
+  void SubstitutableString::Render(Context& ctx, Sink& sink,
+                                   const std::vector<std::string>& args)
+    const {
+    Context::Reader reader(ctx);
+    Render(ctx, *reader.lang, sink, args);
+  }
+  template<class Sink>
+  void SubstitutableString::Render(Context& ctx, const LoadedLanguage& lang,
+                                   Sink& sink,
+                                   const std::vector<std::string>& args)
+    const {
+    const char* storage = GetStorage();
+    if(code_len == 0) {
+      sink.Write(storage, storage_len);
+      return;
+    }
+    auto it = GetCode();
+    auto code_end = it + code_len;
+    while(it != code_end) {
+      if(*it < 0) {
+        if(*it > -100) {
+          int ref = -*it++;
+          if(ref > (int)args.size()) {
+            sink.Put('$');
+            if(ref >= 10) sink.Put('0' + ref / 10);
+            sink.Put('0' + ref % 10);
+          }
+          else
+            sink.Write(args[ref-1].data(), args[ref-1].length());
+        }
+        else {
+          int32_t start = (*it++) & 0x7FFFFFFF;
+          int32_t len = *it++;
+          uint32_t hash = static_cast<uint32_t>(*it++);
+          ConstKey key(storage + start, len, hash);
+          ctx.RenderLookedUp(lang, sink, key, lang.Find(key), {});
+        }
+      }
+      else {
+        int32_t start = *it++;
+        int32_t len = *it++;
+        sink.Write(storage + start, len);
+      }
+    }
+  }
+  template<class Sink>
+  void Context::RenderLookedUp(const LoadedLanguage& lang, Sink& sink,
+                               const Key& key, const SubstitutableString* p,
+                               const std::vector<std::string>& args) {
+    if(p) p->Render(*this, lang, sink, args);
+    else {
+      std::vector<std::string> fake_args{key.AsString()};
+      GetMissingKeyMessage(lang, key).Render(*this, lang, sink, fake_args);
+    }
+  }
 }
 
 static inline constexpr SN::ConstKey operator""_Key(const char* p, size_t len){
@@ -1,207 +1,800 @@
 // This file contains all *required* components of SN.
 
-#include "sn.hh"
+#include "sn_internal.hh"
 
 #include <sstream>
+#include <algorithm>
+#include <new>
+#include <unordered_set>
+#include <deque>
 
 using namespace SN;
 
+#if defined(__GNUC__)
+#define SN_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define SN_PREFETCH(p) ((void)(p))
+#endif
+
+// (SIMD needs __builtin_ctz too, so only GCC-compatible compilers get it)
+#if defined(__GNUC__) && defined(__AVX2__)
+#define SN_SIMD_AVX2 1
+#define SN_SIMD_SSE2 1
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__SSE2__)
+#define SN_SIMD_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// how many keys LookupMany fetches ahead of the ones it is comparing
+static const size_t LOOKUP_BATCH = 32;
+
+static std::atomic<uint32_t> last_generation(0);
+static uint32_t new_generation() {
+  uint32_t ret;
+  // zero is reserved for handles that were never resolved
+  do ret = ++last_generation; while(ret == 0);
+  return ret;
+}
+
 const std::string SN::DEFAULT_LANGUAGE = "en-US";
 const SubstitutableString NO_SUCH_KEY("<No such key: $1>");
 
+#define SN_CHARS(n) \
+  char(n+0), char(n+1), char(n+2), char(n+3), char(n+4), char(n+5), \
+  char(n+6), char(n+7), char(n+8), char(n+9), char(n+10), char(n+11), \
+  char(n+12), char(n+13), char(n+14), char(n+15)
+const char SegmentSink::CHARACTERS[256] = {
+  SN_CHARS(0x00), SN_CHARS(0x10), SN_CHARS(0x20), SN_CHARS(0x30),
+  SN_CHARS(0x40), SN_CHARS(0x50), SN_CHARS(0x60), SN_CHARS(0x70),
+  SN_CHARS(0x80), SN_CHARS(0x90), SN_CHARS(0xA0), SN_CHARS(0xB0),
+  SN_CHARS(0xC0), SN_CHARS(0xD0), SN_CHARS(0xE0), SN_CHARS(0xF0)
+};
+#undef SN_CHARS
+
+void SegmentSink::Clear() {
+  count = 0;
+  length = 0;
+  last_end = nullptr;
+  languages.clear();
+  missing_key_args.clear();
+}
+
 CatSource::~CatSource() {}
 
-SubstitutableString::SubstitutableString() {}
-
-SubstitutableString::SubstitutableString(const std::string& raw) {
-  auto raw_it = raw.cbegin();
-  auto raw_end = raw.cend();
-  int out_len = 0;
-  while(raw_it != raw_end) {
-    switch(*raw_it) {
-    case '\\':
-      ++raw_it;
-      if(raw_it != raw_end) {
-        if(*raw_it > ' ' && *raw_it < 127)
-          ++out_len;
-        ++raw_it;
-      }
-      break;
-    case '$':
-      ++raw_it;
-      if(raw_it != raw_end && *raw_it >= '1' && *raw_it <= '9') {
-        ++raw_it;
-        if(raw_it != raw_end && *raw_it >= '0' && *raw_it <= '9') {
-          ++raw_it;
-        }
-        break;
-      }
-      else if(*raw_it == '(') {
-        auto old_it = raw_it;
-        int old_out_len = out_len;
-        ++raw_it;
-        bool fall_through = true;
-        while(raw_it != raw_end) {
-          if((*raw_it >= 'A' && *raw_it <= 'Z')
-             || (*raw_it >= 'a' && *raw_it <= 'z')
-             || (*raw_it >= '0' && *raw_it <= '9')
-             || *raw_it == '_') {
-            ++raw_it;
-            ++out_len;
-          }
-          else if(*raw_it == ')') {
-            ++raw_it;
-            fall_through = false;
-            break;
-          }
-        }
-        if(!fall_through) break;
-        // falling through
-        raw_it = old_it;
-        out_len = old_out_len;
-      }
-      ++out_len;
-      break;
-    default:
-      ++raw_it;
-      ++out_len;
-      break;
-    }
-  }
-  storage.reserve(out_len);
-  raw_it = raw.cbegin();
-  int out_start = 0;
-  while(raw_it != raw_end) {
-    switch(*raw_it) {
-    case '\\':
-      ++raw_it;
-      if(raw_it != raw_end) {
-        if(*raw_it > ' ' && *raw_it < 127)
-          storage.push_back(*raw_it);
-        ++raw_it;
+std::vector<std::future<std::unique_ptr<std::istream> > >
+CatSource::FetchCats(const std::vector<std::string>& cats, size_t&) {
+  std::vector<std::future<std::unique_ptr<std::istream> > > ret;
+  ret.reserve(cats.size());
+  for(auto& cat : cats)
+    ret.push_back(std::async(std::launch::deferred,
+                             [this, cat]() { return OpenCat(cat); }));
+  return ret;
+}
+
+SubstitutableString::SubstitutableString()
+  : owned(nullptr), offset(0), code_len(0), storage_len(0) {}
+
+// Returns the first '\\' or '$' in [p, end), or end if there is none. Most
+// message text has neither, so this is where compiling spends its time.
+static inline const char* find_special(const char* p, const char* end) {
+#if defined(SN_SIMD_AVX2)
+  const __m256i backslashes = _mm256_set1_epi8('\\');
+  const __m256i dollars = _mm256_set1_epi8('$');
+  while(end - p >= 32) {
+    __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    uint32_t mask = _mm256_movemask_epi8
+      (_mm256_or_si256(_mm256_cmpeq_epi8(chunk, backslashes),
+                       _mm256_cmpeq_epi8(chunk, dollars)));
+    if(mask != 0) return p + __builtin_ctz(mask);
+    p += 32;
+  }
+#endif
+#if defined(SN_SIMD_SSE2)
+  const __m128i backslashes16 = _mm_set1_epi8('\\');
+  const __m128i dollars16 = _mm_set1_epi8('$');
+  while(end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    uint32_t mask = _mm_movemask_epi8
+      (_mm_or_si128(_mm_cmpeq_epi8(chunk, backslashes16),
+                    _mm_cmpeq_epi8(chunk, dollars16)));
+    if(mask != 0) return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  while(p != end && *p != '\\' && *p != '$') ++p;
+  return p;
+}
+
+static inline bool is_key_char(char c) {
+  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')
+    || (c >= '0' && c <= '9') || c == '_';
+}
+
+// emits the literal text since the last substitution, if there is any
+static inline void flush_literal(std::vector<int32_t>& code,
+                                 int32_t& out_start, int32_t out_len) {
+  if(out_start != out_len) {
+    code.push_back(out_start);
+    code.push_back(out_len - out_start);
+    out_start = out_len;
+  }
+}
+
+SubstitutableString::SubstitutableString(const std::string& raw)
+  : SubstitutableString() {
+  // Reused between calls, so that compiling doesn't allocate anything but the
+  // block itself. Text only ever shrinks, so raw.length() bytes is enough.
+  static thread_local std::vector<char> text_buf;
+  static thread_local std::vector<int32_t> code;
+  if(text_buf.size() < raw.length()) text_buf.resize(raw.length());
+  code.clear();
+  char* text = text_buf.data();
+  int32_t out_len = 0, out_start = 0;
+  const char* p = raw.data();
+  const char* end = p + raw.length();
+  while(true) {
+    const char* special = find_special(p, end);
+    if(special != p) {
+      memcpy(text + out_len, p, special - p);
+      out_len += special - p;
+      p = special;
+    }
+    if(p == end) break;
+    if(*p++ == '\\') {
+      // only printable characters can be escaped; anything else is dropped
+      // along with the backslash
+      if(p != end) {
+        if(*p > ' ' && *p < 127)
+          text[out_len++] = *p;
+        ++p;
       }
-      break;
-    case '$':
-      ++raw_it;
-      if(raw_it != raw_end) {
-        if(*raw_it >= '1' && *raw_it <= '9') {
-          int cur_len = storage.length();
-          if(out_start != cur_len) {
-            code.push_back(out_start);
-            code.push_back(cur_len - out_start);
-            out_start = cur_len;
-          }
-          int ref = *raw_it-'0';
-          ++raw_it;
-          if(raw_it != raw_end && *raw_it >= '0' && *raw_it <= '9') {
-            ref = ref * 10 + (*raw_it-'0');
-            ++raw_it;
-          }
-          code.push_back(-ref);
-          break;
-        }
-        else if(*raw_it == '(') {
-          auto old_it = raw_it;
-          auto old_storage_size = storage.size();
-          int old_len = storage.length();
-          ++raw_it;
-          bool fall_through = true;
-          while(raw_it != raw_end) {
-            if((*raw_it >= 'A' && *raw_it <= 'Z')
-                    || (*raw_it >= 'a' && *raw_it <= 'z')
-                    || (*raw_it >= '0' && *raw_it <= '9')
-                    || *raw_it == '_') {
-              storage.push_back(*raw_it++);
-            }
-            else if(*raw_it == ')') {
-              ++raw_it;
-              int cur_len = storage.length();
-              if(cur_len == old_len) break; // empty, fall through
-              if(out_start != old_len) {
-                code.push_back(out_start);
-                code.push_back(old_len - out_start);
-              }
-              code.push_back(old_len | -2147483648);
-              code.push_back(cur_len - old_len);
-              code.push_back(static_cast<int32_t>
-                             (Key::CalculateHash(storage.cbegin()+old_len,
-                                                 storage.cbegin()+cur_len)));
-              out_start = cur_len;
-              fall_through = false;
-              break;
-            }
-          }
-          if(!fall_through) break;
-          // falling through
-          raw_it = old_it;
-          storage.resize(old_storage_size);
-        }
+      continue;
+    }
+    // a '$'...
+    if(p != end && *p >= '1' && *p <= '9') {
+      // ...followed by a one- or two-digit argument number
+      flush_literal(code, out_start, out_len);
+      int32_t ref = *p++ - '0';
+      if(p != end && *p >= '0' && *p <= '9')
+        ref = ref * 10 + (*p++ - '0');
+      code.push_back(-ref);
+      continue;
+    }
+    else if(p != end && *p == '(') {
+      // ...followed by a non-empty parenthesized key name
+      const char* name = p + 1;
+      const char* name_end = name;
+      while(name_end != end && is_key_char(*name_end)) ++name_end;
+      if(name_end != end && *name_end == ')' && name_end != name) {
+        flush_literal(code, out_start, out_len);
+        int32_t name_len = name_end - name;
+        memcpy(text + out_len, name, name_len);
+        code.push_back(static_cast<int32_t>(uint32_t(out_len) | 0x80000000U));
+        code.push_back(name_len);
+        code.push_back(static_cast<int32_t>
+                       (Key::CalculateHash(name, name_end)));
+        out_len += name_len;
+        out_start = out_len;
+        p = name_end + 1;
+        continue;
       }
-      storage.push_back('$');
-      // fallthrough
-    default:
-      storage.push_back(*raw_it);
-      ++raw_it;
-      break;
     }
+    // ...that is just a '$'. (Whatever follows it is copied as-is, even
+    // another '$' or a backslash.)
+    text[out_len++] = '$';
+    if(p != end) text[out_len++] = *p++;
   }
-  int cur_len = storage.length();
-  if(out_start != cur_len && !code.empty()) {
-    code.push_back(out_start);
-    code.push_back(cur_len - out_start);
+  if(!code.empty()) flush_literal(code, out_start, out_len);
+  code_len = code.size();
+  storage_len = out_len;
+  if(GetBlockSize() != 0) {
+    owned = AllocateBlock(GetBlockSize());
+    if(code_len != 0)
+      memcpy(owned, code.data(), code_len * sizeof(int32_t));
+    if(storage_len != 0)
+      memcpy(owned + code_len * sizeof(int32_t), text, storage_len);
+  }
+}
+
+// (keeps the block after it 8-byte aligned)
+static const size_t BLOCK_HEADER_SIZE = 8;
+
+static inline std::atomic<uint32_t>* get_block_refs(char* block) {
+  return reinterpret_cast<std::atomic<uint32_t>*>(block - BLOCK_HEADER_SIZE);
+}
+
+char* SubstitutableString::AllocateBlock(size_t size) {
+  char* raw = new char[BLOCK_HEADER_SIZE + size];
+  new(raw) std::atomic<uint32_t>(1);
+  return raw + BLOCK_HEADER_SIZE;
+}
+
+void SubstitutableString::ReleaseBlock(char* block) {
+  auto refs = get_block_refs(block);
+  if(refs->fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    refs->~atomic();
+    delete[] (block - BLOCK_HEADER_SIZE);
+  }
+}
+
+SubstitutableString::SubstitutableString(uint32_t code_len,
+                                         uint32_t storage_len, char* block)
+  : owned(nullptr), offset(block - reinterpret_cast<char*>(this)),
+    code_len(code_len), storage_len(storage_len) {}
+
+SubstitutableString::SubstitutableString(const SubstitutableString& other)
+  : owned(nullptr), offset(0), code_len(other.code_len),
+    storage_len(other.storage_len) {
+  if(other.owned != nullptr) {
+    owned = other.owned;
+    get_block_refs(owned)->fetch_add(1, std::memory_order_relaxed);
+  }
+  else if(GetBlockSize() != 0) {
+    // a packed string's block belongs to its arena; we need our own copy
+    owned = AllocateBlock(GetBlockSize());
+    memcpy(owned, other.GetBlock(), GetBlockSize());
+  }
+}
+
+SubstitutableString::SubstitutableString(SubstitutableString&& other)
+  : SubstitutableString() {
+  Adopt(std::move(other));
+}
+
+SubstitutableString::~SubstitutableString() {
+  if(owned != nullptr) ReleaseBlock(owned);
+}
+
+SubstitutableString&
+SubstitutableString::operator=(const SubstitutableString& other) {
+  if(this != &other) Adopt(SubstitutableString(other));
+  return *this;
+}
+
+SubstitutableString&
+SubstitutableString::operator=(SubstitutableString&& other) {
+  if(this != &other) Adopt(std::move(other));
+  return *this;
+}
+
+void SubstitutableString::Adopt(SubstitutableString&& other) {
+  if(other.owned == nullptr && other.GetBlockSize() != 0) {
+    // a packed string's block belongs to its arena; we need our own copy
+    Adopt(SubstitutableString(other));
+    return;
   }
+  if(owned != nullptr) ReleaseBlock(owned);
+  owned = other.owned;
+  offset = 0;
+  code_len = other.code_len;
+  storage_len = other.storage_len;
+  other.owned = nullptr;
+  other.code_len = 0;
+  other.storage_len = 0;
 }
 
 void SubstitutableString::operator()(Context& ctx, std::ostream& out,
                                      const std::vector<std::string>& args)
   const {
-  if(code.empty()) out << storage;
+  OstreamSink sink(out);
+  Render(ctx, sink, args);
+}
+
+// The messages that a lazy key filter (see Context::SetKeyFilter) left out of
+// a language, indexed by group, and the groups that have been loaded since
+class LoadedLanguage::LazyGroups {
+public:
+  // where some of a group's messages are in one cat
+  struct Range {
+    uint32_t cat; // index into cats
+    uint64_t offset, length;
+  };
+private:
+  struct Group {
+    std::string name;
+    uint32_t hash;
+    std::vector<Range> ranges;
+    // loaded.get(), once loaded, for lookups, which don't take mutex
+    std::atomic<const LoadedLanguage*> ready;
+    std::unique_ptr<LoadedLanguage> loaded;
+    Group(std::string name, uint32_t hash)
+      : name(std::move(name)), hash(hash), ready(nullptr) {}
+  };
+  LanguageTag code;
+  bool compact;
+  std::vector<std::pair<std::shared_ptr<CatSource>, std::string> > cats;
+  std::deque<Group> groups;
+  // group names to indices into groups; only used until Freeze
+  std::unordered_map<std::string, uint32_t> index;
+  // open-addressed (linear probing); indices into groups, -1 if empty
+  std::vector<int32_t> slots;
+  unsigned int shift;
+  // held while loading a group
+  std::mutex mutex;
+  const LoadedLanguage* Load(Group& group);
+public:
+  LazyGroups(LanguageTag code, bool compact) : code(code), compact(compact) {}
+  uint32_t AddCat(std::shared_ptr<CatSource> source,
+                  const std::string& cat);
+  void AddRange(const std::string& group, const Range& range);
+  // makes the groups ready for lookups; nothing can be added after
+  void Freeze();
+  inline bool Empty() const { return groups.empty(); }
+  // loads the key's group if it isn't already; nullptr if it's missing
+  const SubstitutableString* Find(const Key& key);
+  // adds in the index and every group loaded so far
+  void AddMemoryUsage(MemoryUsage& usage);
+};
+
+LoadedLanguage::LoadedLanguage(LanguageTag code, uint32_t source_generation)
+  : code(code), source_generation(source_generation),
+    generation(new_generation()), arena_size(0), packed(false),
+    messages(nullptr), message_count(0),
+    table(nullptr), table_shift(32), hot_table(nullptr), hot_table_shift(32),
+    keys(nullptr), counting(nullptr) {
+  memory_usage.tables = sizeof(LoadedLanguage);
+}
+
+LoadedLanguage::~LoadedLanguage() {
+  for(uint32_t n = 0; n < message_count; ++n)
+    messages[n].~SubstitutableString();
+}
+
+// FNV-1a, for finding identical message blocks
+static uint64_t hash_block(const char* p, size_t size) {
+  uint64_t ret = 0xCBF29CE484222325ULL;
+  for(size_t n = 0; n < size; ++n) {
+    ret ^= static_cast<unsigned char>(p[n]);
+    ret *= 0x100000001B3ULL;
+  }
+  return ret;
+}
+
+void LoadedLanguage::Build(std::unordered_map<std::string,
+                                              SubstitutableString>& intermap,
+                           bool compact,
+                           const std::vector<const LoadedLanguage*>& donors,
+                           const std::vector<std::string>& hot_keys) {
+  if(intermap.empty()) return;
+  size_t count = intermap.size();
+  // keep the table at most 3/4 full
+  unsigned int shift = get_table_shift(count + count / 3 + 1);
+  size_t table_size = size_t(1) << (32 - shift);
+  // The hot messages, most used first, then all the others. Everything goes
+  // into the arena in this order, so the hot messages, keys and blocks all
+  // end up together at the front of their sections.
+  typedef std::unordered_map<std::string, SubstitutableString>::iterator
+    Entry;
+  std::vector<Entry> order;
+  order.reserve(count);
+  size_t hot_count;
+  {
+    std::unordered_set<const SubstitutableString*> hot;
+    for(auto& key : hot_keys) {
+      auto it = intermap.find(key);
+      if(it != intermap.end() && hot.insert(&it->second).second)
+        order.push_back(it);
+    }
+    hot_count = order.size();
+    for(auto it = intermap.begin(); it != intermap.end(); ++it) {
+      if(!hot.count(&it->second)) order.push_back(it);
+    }
+  }
+  // keep the hot table at most half full
+  unsigned int hot_shift = hot_count != 0 ? get_table_shift(hot_count * 2) : 32;
+  size_t hot_table_size = hot_count != 0 ? size_t(1) << (32 - hot_shift) : 0;
+  // Every distinct block seen so far, by content, and whether it belongs to
+  // a donor. A message identical to one of these is made to share its block
+  // instead, preferring one of ours. (The donors' packed blocks belong to
+  // their arenas, so those can't be shared. Neither can their other blocks
+  // with a message whose block we are packing, or we would end up with two
+  // copies.)
+  std::unordered_multimap<uint64_t, std::pair<const SubstitutableString*,
+                                              bool> > blocks;
+  if(!compact) {
+    for(auto donor : donors) {
+      for(uint32_t n = 0; n < donor->message_count; ++n) {
+        auto& message = donor->messages[n];
+        if(message.owned == nullptr) continue;
+        blocks.emplace(hash_block(message.GetBlock(), message.GetBlockSize()),
+                       std::make_pair(&message, true));
+      }
+    }
+  }
+  size_t key_bytes = 0, block_bytes = 0, packed_bytes = 0;
+  // the blocks that will be packed, by their current owner
+  std::unordered_set<const char*> to_pack;
+  // the donors' blocks that we share (they count against the donors, not us)
+  std::unordered_set<const char*> donor_blocks;
+  for(size_t n = 0; n < count; ++n) {
+    key_bytes += order[n]->first.length();
+    auto& message = order[n]->second;
+    bool pack = compact || n < hot_count;
+    size_t size = message.GetBlockSize();
+    if(size == 0) continue;
+    uint64_t hash = hash_block(message.GetBlock(), size);
+    const SubstitutableString* same = nullptr;
+    bool same_is_donors = false;
+    auto range = blocks.equal_range(hash);
+    for(auto it = range.first; it != range.second; ++it) {
+      bool donors = it->second.second;
+      if(donors && (pack || same)) continue;
+      if(it->second.first->SameBlock(message)) {
+        same = it->second.first;
+        same_is_donors = donors;
+        if(!donors) break;
+      }
+    }
+    if(same) {
+      memory_usage.deduplicated += size;
+      if(same->owned != message.owned) message = *same;
+      if(same_is_donors) donor_blocks.insert(message.owned);
+    }
+    else {
+      blocks.emplace(hash, std::make_pair(&message, false));
+      memory_usage.text += message.storage_len;
+      memory_usage.code += message.code_len * sizeof(int32_t);
+    }
+    if(pack && to_pack.insert(message.owned).second) {
+      block_bytes += align_up(size, PACKED_BLOCK_ALIGNMENT);
+      packed_bytes += size;
+    }
+  }
+  // (free these before allocating the arena, to keep the peak down)
+  decltype(blocks)().swap(blocks);
+  decltype(to_pack)().swap(to_pack);
+  size_t hot_table_start = count * sizeof(SubstitutableString);
+  size_t table_start = hot_table_start + hot_table_size * sizeof(Slot);
+  size_t keys_start = table_start + table_size * sizeof(Slot);
+  size_t blocks_start = align_up(keys_start + key_bytes,
+                                 PACKED_BLOCK_ALIGNMENT);
+  arena_size = align_up(blocks_start + block_bytes, sizeof(uint64_t));
+  packed = compact;
+  arena.reset(new uint64_t[arena_size / sizeof(uint64_t)]);
+  char* base = reinterpret_cast<char*>(arena.get());
+  messages = reinterpret_cast<SubstitutableString*>(base);
+  Slot* hot_slots = reinterpret_cast<Slot*>(base + hot_table_start);
+  Slot* slots = reinterpret_cast<Slot*>(base + table_start);
+  char* key_p = base + keys_start;
+  char* block_p = base + blocks_start;
+  for(size_t n = 0; n < hot_table_size; ++n)
+    hot_slots[n].message = NO_MESSAGE;
+  for(size_t n = 0; n < table_size; ++n) slots[n].message = NO_MESSAGE;
+  if(hot_count != 0) {
+    hot_table = hot_slots;
+    hot_table_shift = hot_shift;
+  }
+  table = slots;
+  table_shift = shift;
+  keys = key_p;
+  // where each packed block went
+  std::unordered_map<const char*, char*> packed;
+  // the distinct blocks of ours that stay on the heap
+  std::unordered_set<const char*> heap_blocks;
+  for(size_t n = 0; n < count; ++n) {
+    auto& key = order[n]->first;
+    auto& message = order[n]->second;
+    auto it = message.GetBlockSize() != 0 ? packed.find(message.owned)
+      : packed.end();
+    if(message.GetBlockSize() == 0 || it != packed.end()
+       || compact || n < hot_count) {
+      char* block = block_p;
+      if(it != packed.end()) block = it->second;
+      else if(message.GetBlockSize() != 0) {
+        memcpy(block_p, message.GetBlock(), message.GetBlockSize());
+        block_p += align_up(message.GetBlockSize(), PACKED_BLOCK_ALIGNMENT);
+        packed.emplace(message.owned, block);
+      }
+      new(messages + message_count)
+        SubstitutableString(message.code_len, message.storage_len, block);
+    }
+    else {
+      if(!donor_blocks.count(message.owned))
+        heap_blocks.insert(message.owned);
+      new(messages + message_count) SubstitutableString(std::move(message));
+    }
+    uint32_t hash = Key::CalculateHash(key.cbegin(), key.cend());
+    Slot slot;
+    slot.hash = hash;
+    slot.message = message_count++;
+    slot.key_offset = key_p - keys;
+    slot.key_length = key.length();
+    // (the hot keys go in first, so they get their home slots in the main
+    // table too)
+    uint32_t i = home_slot(hash, table_shift);
+    while(slots[i].message != NO_MESSAGE)
+      i = (i + 1) & (table_size - 1);
+    slots[i] = slot;
+    if(n < hot_count) {
+      i = home_slot(hash, hot_table_shift);
+      while(hot_slots[i].message != NO_MESSAGE)
+        i = (i + 1) & (hot_table_size - 1);
+      hot_slots[i] = slot;
+    }
+    memcpy(key_p, key.data(), key.length());
+    key_p += key.length();
+    // Each entry is freed as soon as it's been copied, so the arena fills as
+    // intermap empties, instead of both being full at once.
+    intermap.erase(order[n]);
+  }
+  memory_usage.keys = key_bytes;
+  memory_usage.tables = sizeof(LoadedLanguage) + arena_size - key_bytes
+    - packed_bytes;
+  // guess at the allocator's overhead for every block we didn't pack
+  memory_usage.tables += heap_blocks.size()
+    * (2 * sizeof(void*) + BLOCK_HEADER_SIZE);
+}
+
+uint32_t LoadedLanguage::Probe(const Slot* slots, unsigned int shift,
+                               const Key& key) const {
+  uint32_t hash = key.GetHashCode();
+  uint32_t mask = 0xFFFFFFFFU >> shift;
+  uint32_t i = home_slot(hash, shift);
+  while(true) {
+    const Slot& slot = slots[i];
+    if(slot.message == NO_MESSAGE) return NO_MESSAGE;
+    if(slot.hash == hash && slot.key_length == key.GetNameLength()
+       && !memcmp(keys + slot.key_offset, key.GetNamePointer(),
+                  slot.key_length))
+      return slot.message;
+    i = (i + 1) & mask;
+  }
+}
+
+uint32_t LoadedLanguage::FindIndex(const Key& key) const {
+  if(message_count == 0) return NO_MESSAGE;
+  if(hot_table) {
+    uint32_t index = Probe(hot_table, hot_table_shift, key);
+    if(index != NO_MESSAGE) return index;
+  }
+  return Probe(table, table_shift, key);
+}
+
+const SubstitutableString* LoadedLanguage::Find(const Key& key) const {
+  uint32_t index = FindIndex(key);
+  if(index == NO_MESSAGE) return lazy ? lazy->Find(key) : nullptr;
+  CountHit(index);
+  return messages + index;
+}
+
+const SubstitutableString*
+LoadedLanguage::Find(const MessageHandle& handle) const {
+  // The generation and index are stored together, so a handle shared between
+  // threads can never pair one language's generation with another's index.
+  // Generations belong to LoadedLanguages, so a handle stays valid across a
+  // switch to another language and back (through the language cache).
+  uint64_t resolved = handle.resolved.load(std::memory_order_relaxed);
+  uint32_t index;
+  if(static_cast<uint32_t>(resolved >> 32) == generation)
+    index = static_cast<uint32_t>(resolved);
   else {
-    auto it = code.cbegin();
-    auto code_end = code.cend();
-    while(it != code_end) {
-      if(*it < 0) {
-        if(*it > -100) {
-          int ref = -*it++;
-          if(ref > (int)args.size())
-            out << '$' << ref;
-          else
-            out << args[ref-1];
-        }
-        else {
-          int32_t start = (*it++) & 0x7FFFFFFF;
-          int32_t len = *it++;
-          uint32_t hash = static_cast<uint32_t>(*it++);
-          ctx.Out(out, ConstKey(storage.data() + start, len, hash), {});
+    index = FindIndex(handle.key);
+    handle.resolved.store((static_cast<uint64_t>(generation) << 32) | index,
+                          std::memory_order_relaxed);
+  }
+  if(index == NO_MESSAGE) return lazy ? lazy->Find(handle.key) : nullptr;
+  CountHit(index);
+  return messages + index;
+}
+
+template<class K>
+void LoadedLanguage::FindMany(const K* keys, size_t count,
+                              const SubstitutableString** out) const {
+  if(message_count == 0) {
+    for(size_t n = 0; n < count; ++n)
+      out[n] = lazy ? lazy->Find(keys[n]) : nullptr;
+    return;
+  }
+  // Work in batches, so that the earliest prefetches aren't evicted before
+  // we get around to using them
+  for(size_t base = 0; base < count; base += LOOKUP_BATCH) {
+    size_t batch_end = std::min(count, base + LOOKUP_BATCH);
+    // The hashes are already in the keys, so we can start fetching every
+    // key's home slot right away (in the hot table too, since Find looks
+    // there first)...
+    for(size_t n = base; n < batch_end; ++n) {
+      uint32_t hash = keys[n].GetHashCode();
+      if(hot_table)
+        SN_PREFETCH(hot_table + home_slot(hash, hot_table_shift));
+      SN_PREFETCH(table + home_slot(hash, table_shift));
+    }
+    // ...and, once those arrive, the names they will be compared against
+    for(size_t n = base; n < batch_end; ++n) {
+      uint32_t hash = keys[n].GetHashCode();
+      if(hot_table) {
+        auto& hot_slot = hot_table[home_slot(hash, hot_table_shift)];
+        if(hot_slot.message != NO_MESSAGE) {
+          SN_PREFETCH(this->keys + hot_slot.key_offset);
+          // (a hot key won't get as far as the main table)
+          if(hot_slot.hash == hash) continue;
         }
       }
-      else {
-        int32_t start = *it++;
-        int32_t len = *it++;
-        out.write(storage.data() + start, len);
-      }
+      auto& slot = table[home_slot(hash, table_shift)];
+      if(slot.message != NO_MESSAGE) SN_PREFETCH(this->keys + slot.key_offset);
     }
+    for(size_t n = base; n < batch_end; ++n)
+      out[n] = Find(keys[n]);
   }
 }
 
+static unsigned int get_reader_stripe() {
+  static std::atomic<unsigned int> next_stripe(0);
+  static thread_local unsigned int stripe = next_stripe++;
+  return stripe;
+}
+
+Context::Reader::Reader(const Context& ctx) {
+  // Either counter will do, since SwitchLanguage waits for both. Our count
+  // must be visible before we load live; see SwitchLanguage.
+  auto& stripe = ctx.reader_stripes[get_reader_stripe() % READER_STRIPES];
+  count = &stripe.count[ctx.reader_epoch.load(std::memory_order_relaxed) & 1];
+  count->fetch_add(1);
+  lang = ctx.live.load();
+}
+
 Context::Context(std::ostream& log)
-  : log(log), langinfo_dirty(true), key_internment(nullptr) {}
+  : log(log), current(std::make_shared<LoadedLanguage>()),
+    live(current.get()), reader_epoch(0), language_request_serial(0),
+    loader_stopping(false), loader_has_request(false),
+    language_cache_budget(0), compact_storage(false), lazy_groups(false),
+    source_generation(0), langinfo_dirty(true), negotiation_table(nullptr),
+    shared_language_version(0), key_profiling(false) {
+  for(auto& stripe : reader_stripes) {
+    stripe.count[0] = 0;
+    stripe.count[1] = 0;
+  }
+}
+
 Context::~Context() {
-  if(key_internment != nullptr) delete[] key_internment;
+  {
+    std::lock_guard<std::mutex> lock(loader_mutex);
+    loader_stopping = true;
+    // make any load in progress give up
+    ++language_request_serial;
+    if(loader_has_request) {
+      loader_request_promise.set_value(false);
+      loader_has_request = false;
+    }
+  }
+  loader_cond.notify_one();
+  if(loader_thread.joinable()) loader_thread.join();
 }
 
 Context& Context::ClearCatSources() {
+  std::lock_guard<std::mutex> lock(load_mutex);
   langinfo_dirty = true;
+  ++source_generation;
+  language_cache.clear();
+  negotiation_table = nullptr;
   cat_sources.clear();
   return *this;
 }
 
 Context& Context::AddCatSource(std::unique_ptr<CatSource> loader) {
+  std::lock_guard<std::mutex> lock(load_mutex);
   langinfo_dirty = true;
+  ++source_generation;
+  language_cache.clear();
+  negotiation_table = nullptr;
   cat_sources.emplace_back(std::move(loader));
   return *this;
 }
 
+Context& Context::SetLanguageCacheBudget(size_t bytes) {
+  std::lock_guard<std::mutex> lock(load_mutex);
+  language_cache_budget = bytes;
+  TrimLanguageCache();
+  return *this;
+}
+
+Context& Context::FlushLanguageCache() {
+  std::lock_guard<std::mutex> lock(load_mutex);
+  language_cache.clear();
+  return *this;
+}
+
+Context& Context::SetCompactStorage(bool compact) {
+  std::lock_guard<std::mutex> lock(load_mutex);
+  compact_storage = compact;
+  // (languages loaded the other way would keep coming back from the cache)
+  ++source_generation;
+  language_cache.clear();
+  return *this;
+}
+
+Context& Context::SetKeyFilter(const std::vector<std::string>& prefixes,
+                               bool lazy) {
+  std::lock_guard<std::mutex> lock(load_mutex);
+  key_filter = prefixes;
+  lazy_groups = lazy;
+  // (languages loaded with the old filter have the wrong messages)
+  ++source_generation;
+  language_cache.clear();
+  return *this;
+}
+
+MemoryUsage Context::GetMemoryUsage() const {
+  std::lock_guard<std::mutex> lock(load_mutex);
+  MemoryUsage ret = current->memory_usage;
+  if(current->lazy) current->lazy->AddMemoryUsage(ret);
+  for(auto& lang : language_cache) {
+    MemoryUsage usage = lang->memory_usage;
+    if(lang->lazy) lang->lazy->AddMemoryUsage(usage);
+    ret.cached += usage.Total();
+  }
+  return ret;
+}
+
+void Context::StartCounting(LoadedLanguage& lang) {
+  if(lang.message_count == 0) return;
+  if(!lang.hit_counts)
+    lang.hit_counts.reset(new std::atomic<uint32_t>[lang.message_count]());
+  lang.counting.store(lang.hit_counts.get(), std::memory_order_release);
+}
+
+Context& Context::SetKeyProfiling(bool profiling) {
+  std::lock_guard<std::mutex> lock(load_mutex);
+  key_profiling = profiling;
+  if(profiling) StartCounting(*current);
+  else current->counting.store(nullptr, std::memory_order_release);
+  return *this;
+}
+
+void Context::WriteKeyProfile(std::ostream& out) const {
+  std::lock_guard<std::mutex> lock(load_mutex);
+  auto& lang = *current;
+  if(!lang.hit_counts) return;
+  std::vector<std::pair<uint32_t, std::string> > profile;
+  size_t table_size = size_t(1) << (32 - lang.table_shift);
+  for(size_t n = 0; n < table_size; ++n) {
+    auto& slot = lang.table[n];
+    if(slot.message == NO_MESSAGE) continue;
+    uint32_t hits = lang.hit_counts[slot.message].load();
+    if(hits == 0) continue;
+    profile.emplace_back(hits, std::string(lang.keys + slot.key_offset,
+                                           slot.key_length));
+  }
+  std::sort(profile.begin(), profile.end(),
+            [](const std::pair<uint32_t, std::string>& a,
+               const std::pair<uint32_t, std::string>& b) {
+              if(a.first != b.first) return a.first > b.first;
+              return a.second < b.second;
+            });
+  for(auto& entry : profile)
+    out << entry.first << '\t' << entry.second << '\n';
+}
+
+Context& Context::LoadKeyProfile(std::istream& profile, size_t max_hot_keys) {
+  std::vector<std::string> keys;
+  std::string line;
+  while(keys.size() < max_hot_keys && std::getline(profile, line)) {
+    // (the count is only there for people to read; a plain list of keys
+    // will do)
+    auto tab = line.find('\t');
+    if(tab != std::string::npos) line.erase(0, tab + 1);
+    if(!line.empty()) keys.emplace_back(std::move(line));
+  }
+  std::lock_guard<std::mutex> lock(load_mutex);
+  hot_keys = std::move(keys);
+  // (languages laid out for the old profile would keep coming back from the
+  // cache)
+  ++source_generation;
+  language_cache.clear();
+  return *this;
+}
+
+void Context::TrimLanguageCache() {
+  size_t total = 0;
+  auto it = language_cache.begin();
+  while(it != language_cache.end()) {
+    total += (*it)->memory_usage.Total();
+    if(total > language_cache_budget) break;
+    ++it;
+  }
+  language_cache.erase(it, language_cache.end());
+}
+
 static std::string lowercasify(const std::string& in) {
   std::string ret;
   ret.reserve(in.length());
@@ -217,12 +810,16 @@ void Context::MaybeGetLanguageList() {
   langinfo.clear();
   for(auto& src : cat_sources) {
     src->GetAvailableCats([this](std::string str) {
-        std::string lc = lowercasify(str);
-        auto it = langinfo.find(lc);
+        LanguageTag tag = LanguageTag::Get(str);
+        if(!tag.IsValid()) {
+          LogMessage(*this) << "SN: Warning: " << "Ignoring cat with invalid language code " << str << std::endl;
+          return;
+        }
+        auto it = langinfo.find(tag);
         if(it == langinfo.end())
-          langinfo.emplace(lc, str);
+          langinfo.emplace(tag, LangInfo(tag, str));
         else if(str != it->second.GetCode())
-          log << "SN: Warning: " << "Multiple cases for " << lc << ": " << it->second.GetCode() << " and " << str << " are both present. Only the first one seen will be used!" << std::endl;
+          LogMessage(*this) << "SN: Warning: " << "Multiple cases for " << tag.GetLowercase() << ": " << it->second.GetCode() << " and " << str << " are both present. Only the first one seen will be used!" << std::endl;
       });
   }
   langinfo_dirty = false;
@@ -246,6 +843,392 @@ static bool get_line_ignoring_comments(int& lineno,
   } while(1);
 }
 
+// Reads lines out of a cat in memory, the same way get_line_ignoring_comments
+// reads them out of a stream. (In particular, a final line with no newline is
+// ignored, as getline would.)
+struct CatLines {
+  const char* p;
+  const char* end;
+  int lineno;
+  bool Next(const char*& line, size_t& length) {
+    while(true) {
+      auto nl = static_cast<const char*>(memchr(p, '\n', end - p));
+      if(!nl) {
+        p = end;
+        return false;
+      }
+      line = p;
+      length = nl - p;
+      p = nl + 1;
+      ++lineno;
+      if(length > 0 && line[length-1] == '\r') --length;
+      if(length > 0 && line[0] == ':') continue; // retry
+      return true;
+    }
+  }
+};
+
+// Returns the length of the group (see Context::SetKeyFilter) that a key
+// belongs to. Keys without an underscore all belong to the empty group, so
+// that a catalog of them doesn't get a group per key.
+static size_t get_key_group_length(const char* key, size_t length) {
+  auto underscore = static_cast<const char*>(memchr(key, '_', length));
+  return underscore ? underscore - key + 1 : 0;
+}
+
+// see Context::SetKeyFilter
+struct KeyFilter {
+  const std::vector<std::string>& prefixes;
+  bool lazy;
+  bool Keeps(const char* key, size_t length) const {
+    static const char MISSING_KEY[] = "__MISSING_KEY__";
+    if(length == sizeof(MISSING_KEY) - 1 && !memcmp(key, MISSING_KEY, length))
+      return true;
+    for(auto& prefix : prefixes) {
+      if(length >= prefix.length()
+         && !memcmp(key, prefix.data(), prefix.length()))
+        return true;
+    }
+    return false;
+  }
+};
+
+// A run of whole messages from a cat, parsed and compiled independently of
+// the others
+struct CatChunk {
+  enum Warning { UNSAFE_KEY, BLANK_STRING, UNTERMINATED_STRING };
+  const char* begin;
+  const char* end;
+  // where begin is in the cat
+  uint64_t offset;
+  // nullptr keeps everything
+  const KeyFilter* filter;
+  // line numbers are relative to the start of the chunk
+  int line_count;
+  std::vector<std::pair<int, Warning> > warnings;
+  // in the order they appear, duplicates included
+  std::vector<std::pair<std::string, SubstitutableString> > messages;
+  // (lazy filters only) runs of consecutive skipped messages in the same
+  // group
+  struct SkippedRun {
+    std::string group;
+    uint64_t offset, length;
+  };
+  std::vector<SkippedRun> skipped;
+};
+
+// Cats with fewer bytes of messages than twice this are parsed on one thread
+static const size_t MIN_CAT_CHUNK = 256 * 1024;
+
+// At most this much of a language's cats is read ahead of parsing, between
+// all the CatSources (see CatSource::FetchCats)
+static const size_t FETCH_BUDGET = 64 * 1024 * 1024;
+
+// Cats are read this much at a time (or more, on machines with enough
+// threads to parse more than this at once)
+static const size_t CAT_WINDOW = 4 * 1024 * 1024;
+
+// Returns how many bytes are left in the stream, or 0 if it can't say
+static size_t get_cat_size(std::istream& in) {
+  size_t ret = 0;
+  auto start = in.tellg();
+  if(start != std::istream::pos_type(-1) && in.seekg(0, std::ios::end)) {
+    auto end = in.tellg();
+    if(end != std::istream::pos_type(-1) && end > start) ret = end - start;
+  }
+  in.clear();
+  in.seekg(start);
+  in.clear();
+  return ret;
+}
+
+// Appends up to amount more bytes of the cat to buf. Returns false if there
+// is nothing more to read.
+static bool read_cat(std::istream& in, std::string& buf, size_t amount) {
+  size_t old_size = buf.size();
+  buf.resize(old_size + amount);
+  in.read(&buf[old_size], amount);
+  buf.resize(old_size + in.gcount());
+  return size_t(in.gcount()) == amount;
+}
+
+// Returns the start of the first line at or after p that is sure to start a
+// new message (or a run of blank lines before one). That is the line after a
+// "." whose previous line is not blank, not a comment, and not another ".";
+// such a "." can only be the end of a message. (After a blank line, it might
+// be a key.)
+static const char* find_message_boundary(const char* begin, const char* p,
+                                         const char* end) {
+  while(true) {
+    auto nl = static_cast<const char*>(memchr(p, '\n', end - p));
+    if(!nl) return end;
+    const char* dot = nl + 1;
+    p = dot;
+    if(dot == end || *dot != '.') continue;
+    const char* next = dot + 1;
+    if(next != end && *next == '\r') ++next;
+    if(next == end || *next != '\n') continue;
+    const char* prev_end = nl;
+    if(prev_end != begin && prev_end[-1] == '\r') --prev_end;
+    const char* prev = nl;
+    while(prev != begin && prev[-1] != '\n') --prev;
+    if(prev == prev_end || *prev == ':'
+       || (prev_end - prev == 1 && *prev == '.'))
+      continue;
+    return next + 1;
+  }
+}
+
+static void split_cat(const char* begin, const char* end,
+                      std::vector<CatChunk>& chunks) {
+  size_t threads = std::thread::hardware_concurrency();
+  size_t size = end - begin;
+  size_t target = std::max(MIN_CAT_CHUNK, size / std::max<size_t>(threads, 1));
+  const char* p = begin;
+  do {
+    const char* next = end;
+    if(threads > 1 && size_t(end - p) >= target * 2)
+      next = find_message_boundary(begin, p + target, end);
+    chunks.emplace_back();
+    chunks.back().begin = p;
+    chunks.back().end = next;
+    chunks.back().offset = p - begin;
+    chunks.back().filter = nullptr;
+    p = next;
+  } while(p != end);
+}
+
+static void parse_cat_chunk(CatChunk& chunk) {
+  CatLines lines{chunk.begin, chunk.end, 0};
+  const char* line;
+  size_t length;
+  std::string text;
+  // whether the last message was skipped, and went into skipped.back()
+  bool last_skipped = false;
+  while(true) {
+    // Skip any number of blank lines
+    bool got_line;
+    while((got_line = lines.Next(line, length)) && length == 0)
+      {}
+    if(!got_line) break;
+    // The entire line is the key
+    const char* key = line;
+    size_t key_length = length;
+    bool keep = !chunk.filter || chunk.filter->Keeps(key, key_length);
+    bool safe_name = true;
+    for(size_t n = 0; n < key_length; ++n) {
+      char c = key[n];
+      if(!((c >= 'A' && c <= 'Z') || (c >= 'a' || c >= 'z')
+           || (c >= '0' && c <= '9') || c == '_')) {
+        safe_name = false;
+        break;
+      }
+    }
+    if(!safe_name)
+      chunk.warnings.emplace_back(lines.lineno, CatChunk::UNSAFE_KEY);
+    text.clear();
+    bool safely_ended = false;
+    // Read up to a line that consists solely of "."
+    if(lines.Next(line, length)) {
+      if(length == 1 && *line == '.') {
+        chunk.warnings.emplace_back(lines.lineno, CatChunk::BLANK_STRING);
+        safely_ended = true;
+      }
+      else {
+        // (a skipped message's lines are only looked at for the ".")
+        if(keep) text.assign(line, length);
+        while(lines.Next(line, length)) {
+          if(length == 1 && *line == '.') {
+            safely_ended = true;
+            break;
+          }
+          if(!keep) continue;
+          text.push_back('\n');
+          text.append(line, length);
+        }
+      }
+    }
+    if(!safely_ended)
+      chunk.warnings.emplace_back(lines.lineno,
+                                  CatChunk::UNTERMINATED_STRING);
+    if(keep) {
+      chunk.messages.emplace_back(std::string(key, key_length),
+                                  SubstitutableString(text));
+      last_skipped = false;
+    }
+    else if(chunk.filter->lazy) {
+      size_t group_length = get_key_group_length(key, key_length);
+      uint64_t offset = chunk.offset + (key - chunk.begin);
+      uint64_t end = chunk.offset + (lines.p - chunk.begin);
+      if(last_skipped && chunk.skipped.back().group.length() == group_length
+         && !memcmp(chunk.skipped.back().group.data(), key, group_length))
+        chunk.skipped.back().length = end - chunk.skipped.back().offset;
+      else {
+        chunk.skipped.push_back(CatChunk::SkippedRun
+                                {std::string(key, group_length), offset,
+                                 end - offset});
+      }
+      last_skipped = true;
+    }
+  }
+  chunk.line_count = lines.lineno;
+}
+
+// If line is a Key-Count header, returns its value. Otherwise, returns zero.
+static size_t parse_key_count(const char* line, size_t length) {
+  static const char NAME[] = "key-count:";
+  const size_t NAME_LENGTH = sizeof(NAME) - 1;
+  if(length <= NAME_LENGTH) return 0;
+  for(size_t n = 0; n < NAME_LENGTH; ++n) {
+    char c = line[n];
+    if(c >= 'A' && c <= 'Z') c |= 0x20;
+    if(c != NAME[n]) return 0;
+  }
+  const char* p = line + NAME_LENGTH;
+  const char* end = line + length;
+  while(p != end && (*p == ' ' || *p == '\t')) ++p;
+  size_t ret = 0;
+  while(p != end && *p >= '0' && *p <= '9') {
+    if(ret > (size_t(-1) - 9) / 10) return 0;
+    ret = ret * 10 + (*p++ - '0');
+  }
+  return ret;
+}
+
+// Parses every chunk, spreading them over as many threads as are useful
+static void parse_cat_chunks(std::vector<CatChunk>& chunks) {
+  if(chunks.size() == 1) {
+    parse_cat_chunk(chunks[0]);
+    return;
+  }
+  std::atomic<size_t> next_chunk(0);
+  auto worker = [&chunks, &next_chunk]() {
+    size_t n;
+    while((n = next_chunk++) < chunks.size())
+      parse_cat_chunk(chunks[n]);
+  };
+  size_t threads = std::min<size_t>(std::thread::hardware_concurrency(),
+                                    chunks.size());
+  std::vector<std::future<void> > helpers;
+  for(size_t n = 1; n < threads; ++n)
+    helpers.push_back(std::async(std::launch::async, worker));
+  worker();
+  // (get() rethrows anything a helper threw, such as bad_alloc)
+  for(auto& helper : helpers) helper.get();
+}
+
+uint32_t LoadedLanguage::LazyGroups::AddCat(std::shared_ptr<CatSource> source,
+                                           const std::string& cat) {
+  cats.emplace_back(std::move(source), cat);
+  return cats.size() - 1;
+}
+
+void LoadedLanguage::LazyGroups::AddRange(const std::string& group,
+                                          const Range& range) {
+  auto it = index.find(group);
+  if(it == index.end()) {
+    it = index.emplace(group, groups.size()).first;
+    groups.emplace_back(group, Key::CalculateHash(group.cbegin(),
+                                                  group.cend()));
+  }
+  groups[it->second].ranges.push_back(range);
+}
+
+void LoadedLanguage::LazyGroups::Freeze() {
+  std::unordered_map<std::string, uint32_t>().swap(index);
+  // (so that Load can read each cat once, front to back)
+  for(auto& group : groups) {
+    std::sort(group.ranges.begin(), group.ranges.end(),
+              [](const Range& a, const Range& b) {
+                if(a.cat != b.cat) return a.cat < b.cat;
+                return a.offset < b.offset;
+              });
+  }
+  // keep the table at most half full
+  shift = get_table_shift(groups.size() * 2);
+  slots.resize(size_t(1) << (32 - shift), -1);
+  for(uint32_t n = 0; n < groups.size(); ++n) {
+    uint32_t i = home_slot(groups[n].hash, shift);
+    while(slots[i] >= 0) i = (i + 1) & (slots.size() - 1);
+    slots[i] = n;
+  }
+}
+
+const SubstitutableString*
+LoadedLanguage::LazyGroups::Find(const Key& key) {
+  const char* name = key.GetNamePointer();
+  size_t length = get_key_group_length(name, key.GetNameLength());
+  uint32_t hash = Key::ExtendHash(Key::CalculateHash(name, name), name,
+                                  length);
+  uint32_t i = home_slot(hash, shift);
+  while(slots[i] >= 0) {
+    auto& group = groups[slots[i]];
+    if(group.hash == hash && group.name.length() == length
+       && !memcmp(group.name.data(), name, length)) {
+      const LoadedLanguage* lang = group.ready.load(std::memory_order_acquire);
+      if(!lang) lang = Load(group);
+      return lang->Find(key);
+    }
+    i = (i + 1) & (slots.size() - 1);
+  }
+  return nullptr;
+}
+
+const LoadedLanguage* LoadedLanguage::LazyGroups::Load(Group& group) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if(group.loaded) return group.loaded.get();
+  std::unordered_map<std::string, SubstitutableString> intermap;
+  std::string text;
+  // (Freeze sorted the ranges by cat, in the order the cats were loaded in,
+  // so later ones override earlier ones, same as in a full load. Each cat's
+  // ranges are together, in order, so each cat is opened once.)
+  auto range = group.ranges.cbegin();
+  while(range != group.ranges.cend()) {
+    uint32_t cat_index = range->cat;
+    auto& cat = cats[cat_index];
+    std::unique_ptr<std::istream> f = cat.first->OpenCat(cat.second);
+    // how far into the cat f is
+    uint64_t pos = 0;
+    for(; range != group.ranges.cend() && range->cat == cat_index; ++range) {
+      if(!f || !f->seekg(range->offset - pos, std::ios::cur)) continue;
+      text.resize(range->length);
+      f->read(&text[0], range->length);
+      text.resize(f->gcount());
+      pos = range->offset + text.size();
+      CatChunk chunk;
+      chunk.begin = text.data();
+      chunk.end = text.data() + text.size();
+      chunk.offset = range->offset;
+      chunk.filter = nullptr;
+      parse_cat_chunk(chunk);
+      for(auto& message : chunk.messages)
+        intermap[std::move(message.first)] = std::move(message.second);
+    }
+  }
+  group.loaded.reset(new LoadedLanguage(code));
+  group.loaded->Build(intermap, compact, std::vector<const LoadedLanguage*>(),
+                      std::vector<std::string>());
+  group.ready.store(group.loaded.get(), std::memory_order_release);
+  return group.loaded.get();
+}
+
+void LoadedLanguage::LazyGroups::AddMemoryUsage(MemoryUsage& usage) {
+  std::lock_guard<std::mutex> lock(mutex);
+  usage.tables += sizeof(LazyGroups) + slots.size() * sizeof(int32_t)
+    + cats.size() * sizeof(cats[0]);
+  for(auto& group : groups) {
+    usage.keys += group.name.length();
+    usage.tables += sizeof(Group) + group.ranges.size() * sizeof(Range);
+    if(!group.loaded) continue;
+    auto& loaded = group.loaded->memory_usage;
+    usage.keys += loaded.keys;
+    usage.text += loaded.text;
+    usage.code += loaded.code;
+    usage.tables += loaded.tables;
+    usage.deduplicated += loaded.deduplicated;
+  }
+}
+
 void Context::MaybeLoadLangInfo(LangInfo& info) {
   if(info.data_loaded) return;
   bool got_some = false;
@@ -267,8 +1250,8 @@ void Context::MaybeLoadLangInfo(LangInfo& info) {
       auto it = line.cbegin();
       while(it != line.cend() && *it != ':') ++it;
       if(it == line.cend()) {
-        log << "SN: Warning: " << info.GetCode() << ": line " << lineno
-            << " gives an invalid header" << std::endl;
+        LogMessage(*this) << "SN: Warning: " << info.GetCode() << ": line "
+                          << lineno << " gives an invalid header" << std::endl;
         continue;
       }
       std::string header_name(line.cbegin(), it);
@@ -280,16 +1263,13 @@ void Context::MaybeLoadLangInfo(LangInfo& info) {
       if(header_name == "language-code") {
         got_code = true;
         if(header_value != info.GetCode())
-          log << "SN: Warning: " << info.GetCode() << ": Code in file doesn't match code in filename" << std::endl;
+          LogMessage(*this) << "SN: Warning: " << info.GetCode() << ": Code in file doesn't match code in filename" << std::endl;
       }
       else if(header_name == "language-name") {
         if(!got_name) {
           got_name = true;
           info.native_name = std::move(header_value);
-          if(!got_enname && info.GetCode().length() >= 2
-             && ((info.GetCode()[0]|0x20) == 'e')
-             && ((info.GetCode()[1]|0x20) == 'n')
-             && (info.GetCode().length() == 2 || info.GetCode()[2] == '-')) {
+          if(!got_enname && info.GetTag().GetLanguage() == "en") {
             // this language is an English language, and did not explicitly
             // specify another English name, so its native name will also serve
             // as its English name
@@ -298,7 +1278,7 @@ void Context::MaybeLoadLangInfo(LangInfo& info) {
           }
         }
         else if(header_value != info.native_name) {
-          log << "SN: Warning: " << info.GetCode() << ": Different files give different native names" << std::endl;
+          LogMessage(*this) << "SN: Warning: " << info.GetCode() << ": Different files give different native names" << std::endl;
         }
       }
       else if(header_name == "language-name-en") {
@@ -307,172 +1287,401 @@ void Context::MaybeLoadLangInfo(LangInfo& info) {
           info.english_name = std::move(header_value);
         }
         else if(header_value != info.english_name) {
-          log << "SN: Warning: " << info.GetCode() << ": Different files give different English names" << std::endl;
+          LogMessage(*this) << "SN: Warning: " << info.GetCode() << ": Different files give different English names" << std::endl;
         }
       }
       else if(header_name == "fallback") {
+        LanguageTag fallback = LanguageTag::Get(header_value);
+        if(!fallback.IsValid() && header_value.length() > 0)
+          LogMessage(*this) << "SN: Warning: " << info.GetCode()
+                            << ": line " << lineno
+                            << " gives an invalid fallback language"
+                            << std::endl;
         if(!got_fallback) {
           got_fallback = true;
-          info.fallback = std::move(header_value);
+          info.fallback = fallback;
         }
-        else if(header_value != info.fallback) {
-          log << "SN: Warning: " << info.GetCode() << ": Different files give"
-            " different fallback languages" << std::endl;
+        else if(fallback != info.fallback) {
+          LogMessage(*this) << "SN: Warning: " << info.GetCode()
+                            << ": Different files give different fallback"
+            " languages" << std::endl;
         }
       }
     } while(get_line_ignoring_comments(lineno, *f, line) && line.size() != 0);
   }
   if(!got_some)
-    log << "SN: Warning: " << "Thought we could handle " << info.GetCode()
-        << ", but we couldn't actually load any cats for it!" << std::endl;
+    LogMessage(*this) << "SN: Warning: " << "Thought we could handle "
+                      << info.GetCode()
+                      << ", but we couldn't actually load any cats for it!"
+                      << std::endl;
   else {
     if(!got_code)
-      log << "SN: Warning: " << info.GetCode() << ": No cat provided a"
-          " Language-Code header." << std::endl;
+      LogMessage(*this) << "SN: Warning: " << info.GetCode()
+                        << ": No cat provided a Language-Code header."
+                        << std::endl;
     if(!got_name)
-      log << "SN: Warning: " << info.GetCode() << ": No cat provided a"
-          " Language-Name header." << std::endl;
+      LogMessage(*this) << "SN: Warning: " << info.GetCode()
+                        << ": No cat provided a Language-Name header."
+                        << std::endl;
     if(!got_enname)
-      log << "SN: Warning: " << info.GetCode() << ": No cat provided a"
-          " Language-Name-en header." << std::endl;
+      LogMessage(*this) << "SN: Warning: " << info.GetCode()
+                        << ": No cat provided a Language-Name-en header."
+                        << std::endl;
     // It's okay if no fallback is given. That simply means no fallback is
     // desired.
   }
 }
 
-// language must already be lowercase!
-void Context::LoadLanguage(const std::string& language,
-                           std::unordered_map<std::string, SubstitutableString>
-                           & intermap) {
-  // log << "For language: " << language << std::endl;
+void Context::GetFallbackChain(LanguageTag language,
+                               std::vector<LangInfo*>& chain,
+                               uint32_t serial) {
+  if(Superseded(serial) || !language.IsValid()) return;
+  // log << "For language: " << language.GetCode() << std::endl;
   auto it = langinfo.find(language);
   if(it == langinfo.end()) {
-    std::string fallback;
-    // log << "No LangInfo found." << std::endl;
-    if(SimpleFallback(language, fallback)) {
-      // log << "Doing SimpleFallback to " << fallback << "..." << std::endl;
-      LoadLanguage(fallback, intermap);
-    }
+    // log << "No LangInfo found. Doing SimpleFallback..." << std::endl;
+    GetFallbackChain(language.GetSimpleFallback(), chain, serial);
   }
   else {
     MaybeLoadLangInfo(it->second);
-    if(it->second.GetFallback().length() > 0) {
-      // log << "Doing Fallback to " << it->second.GetFallback() << "..." << std::endl;
-      LoadLanguage(it->second.GetFallback(), intermap);
+    if(it->second.GetFallback().IsValid()) {
+      // log << "Doing Fallback to " << it->second.GetFallback().GetCode() << "..." << std::endl;
+      GetFallbackChain(it->second.GetFallback(), chain, serial);
     }
-    // log << "Now loading: " << it->second.GetCode() << std::endl;
-    for(auto& src : cat_sources) {
-      std::unique_ptr<std::istream> f = src->OpenCat(it->second.GetCode());
+    chain.push_back(&it->second);
+  }
+}
+
+void Context::LoadLanguage(LanguageTag language,
+                           std::unordered_map<std::string, SubstitutableString>
+                           & intermap, uint32_t serial,
+                           LoadedLanguage::LazyGroups* lazy) {
+  std::vector<LangInfo*> chain;
+  GetFallbackChain(language, chain, serial);
+  if(Superseded(serial) || chain.empty()) return;
+  std::vector<std::string> codes;
+  for(auto info : chain) codes.push_back(info->GetCode());
+  // Ask for every cat up front, so that the later ones are read while the
+  // earlier ones are parsed
+  std::vector<std::vector<std::future<std::unique_ptr<std::istream> > > >
+    fetched;
+  size_t budget = FETCH_BUDGET;
+  for(auto& src : cat_sources)
+    fetched.push_back(src->FetchCats(codes, budget));
+  for(size_t n = 0; n < chain.size(); ++n) {
+    // log << "Now loading: " << chain[n]->GetCode() << std::endl;
+    for(size_t i = 0; i < cat_sources.size(); ++i) {
+      if(Superseded(serial)) return;
+      std::unique_ptr<std::istream> f = fetched[i][n].get();
       if(!f) continue;
-      int lineno = 0;
-      std::string line;
-      std::ostringstream stream;
-      // Read until we get a non-blank line
-      while(get_line_ignoring_comments(lineno, *f, line) && line.size() == 0)
-        {}
-      // Read until we get a blank line
-      while(get_line_ignoring_comments(lineno, *f, line) && line.size() != 0)
-        {}
-      // Now we read the keys!
-      while(f->good()) {
-        // Skip any number of blank lines
-        while(get_line_ignoring_comments(lineno, *f, line) && line.size() == 0)
-          {}
-        if(!f->good()) break;
-        // The entire line is the key
-        std::string key = line;
-        bool safe_name = true;
-        for(char c : key) {
-          if(!((c >= 'A' && c <= 'Z') || (c >= 'a' || c >= 'z')
-               || (c >= '0' && c <= '9') || c == '_')) {
-            safe_name = false;
-            break;
-          }
-        }
-        if(!safe_name) {
-          log << "SN: Warning: " << it->second.GetCode() << ": line " << lineno
-              << " designates an unsafely-named key" << std::endl
-              << "(safe keys contain only letters, numbers, and underscores)"
-              << std::endl;
-        }
-        stream.str("");
-        stream.clear();
-        bool safely_ended = false;
-        // Read up to a line that consists solely of "."
-        if(get_line_ignoring_comments(lineno, *f, line)) {
-          if(line == ".") {
-            log << "SN: Warning: " << it->second.GetCode() << ": line "
-                << lineno << " gives a blank string" << std::endl;
-            safely_ended = true;
-          }
-          else {
-            stream << line;
-            while(get_line_ignoring_comments(lineno, *f, line)) {
-              if(line == ".") {
-                safely_ended = true;
-                break;
-              }
-              stream << '\n' << line;
-            }
-          }
+      LoadCat(*chain[n], cat_sources[i], *f, intermap, serial, lazy);
+    }
+  }
+}
+
+void Context::LoadCat(LangInfo& info, const std::shared_ptr<CatSource>& src,
+                      std::istream& f,
+                      std::unordered_map<std::string, SubstitutableString>
+                      & intermap, uint32_t serial,
+                      LoadedLanguage::LazyGroups* lazy) {
+  KeyFilter filter{key_filter, lazy != nullptr};
+  const KeyFilter* active_filter
+    = key_filter.empty() && !lazy ? nullptr : &filter;
+  uint32_t cat_index = lazy ? lazy->AddCat(src, info.GetCode()) : 0;
+  // The cat is read a window at a time, and each window's messages are merged
+  // in before the next is read, so that we never hold the whole cat, let
+  // alone the whole cat and all its parsed messages at once.
+  size_t cat_size = get_cat_size(f);
+  size_t window = std::max(CAT_WINDOW, MIN_CAT_CHUNK * 2
+                           * std::thread::hardware_concurrency());
+  // (a small cat can be read all at once; the extra byte lets us see
+  // that we reached the end)
+  if(cat_size != 0) window = std::min(window, cat_size + 1);
+  std::string buf;
+  // where buf starts in the cat
+  uint64_t buf_offset = 0;
+  // (a window, plus what's left over from the last one)
+  buf.reserve(window + window / 4);
+  bool more = true;
+  size_t key_count = 0;
+  const char* line;
+  size_t length;
+  CatLines lines;
+  // The headers have to fit in the buffer all at once
+  while(true) {
+    if(more) more = read_cat(f, buf, window);
+    lines = CatLines{buf.data(), buf.data() + buf.size(), 0};
+    // Read until we get a non-blank line
+    bool got_line;
+    while((got_line = lines.Next(line, length)) && length == 0)
+      {}
+    // Read until we get a blank line, noting the Key-Count header, if
+    // any
+    while(got_line && length != 0) {
+      size_t count = parse_key_count(line, length);
+      if(count != 0) key_count = count;
+      got_line = lines.Next(line, length);
+    }
+    if(got_line || !more) break;
+  }
+  if(key_count != 0 && cat_size != 0) {
+    // (every message takes at least four bytes, which bounds how much a
+    // wrong header can make us reserve)
+    intermap.reserve(intermap.size() + std::min(key_count, cat_size / 4));
+  }
+  // Now we read the keys!
+  int lineno = lines.lineno;
+  size_t consumed = lines.p - buf.data();
+  while(true) {
+    const char* begin = buf.data() + consumed;
+    const char* end = buf.data() + buf.size();
+    const char* cut = end;
+    if(more) {
+      // Leave the (probably partial) last message for next time. If
+      // there's no safe place to cut in the last quarter of the buffer,
+      // read more and try again.
+      cut = find_message_boundary(begin, end - (end - begin) / 4, end);
+      if(cut == end) {
+        more = read_cat(f, buf, window);
+        continue;
+      }
+    }
+    std::vector<CatChunk> chunks;
+    split_cat(begin, cut, chunks);
+    for(auto& chunk : chunks) {
+      chunk.offset += buf_offset + (begin - buf.data());
+      chunk.filter = active_filter;
+    }
+    parse_cat_chunks(chunks);
+    size_t message_count = 0;
+    for(auto& chunk : chunks) message_count += chunk.messages.size();
+    intermap.reserve(intermap.size() + message_count);
+    for(auto& chunk : chunks) {
+      for(auto& warning : chunk.warnings) {
+        LogMessage message(*this);
+        message << "SN: Warning: " << info.GetCode();
+        switch(warning.second) {
+        case CatChunk::UNSAFE_KEY:
+          message << ": line " << (lineno + warning.first)
+                  << " designates an unsafely-named key" << std::endl
+                  << "(safe keys contain only letters, numbers, and"
+            " underscores)" << std::endl;
+          break;
+        case CatChunk::BLANK_STRING:
+          message << ": line " << (lineno + warning.first)
+                  << " gives a blank string" << std::endl;
+          break;
+        case CatChunk::UNTERMINATED_STRING:
+          message << ": unterminated string" << std::endl;
+          break;
         }
-        if(!safely_ended)
-          log << "SN: Warning: " << it->second.GetCode()
-              << ": unterminated string" << std::endl;
-        intermap[key] = stream.str();
+      }
+      lineno += chunk.line_count;
+      for(auto& message : chunk.messages)
+        intermap[std::move(message.first)] = std::move(message.second);
+      // (free each chunk as soon as it's merged)
+      std::vector<std::pair<std::string, SubstitutableString> >()
+        .swap(chunk.messages);
+      if(lazy) {
+        for(auto& run : chunk.skipped)
+          lazy->AddRange(run.group, LoadedLanguage::LazyGroups::Range
+                         {cat_index, run.offset, run.length});
       }
     }
+    if(!more) break;
+    buf_offset += cut - buf.data();
+    buf.erase(0, cut - buf.data());
+    consumed = 0;
+    if(Superseded(serial)) return;
+    more = read_cat(f, buf, window);
   }
 }
 
-Context& Context::SetLanguage(const std::string& language) {
-  MaybeGetLanguageList();
-  loaded_keys.clear();
-  std::string lowercase = lowercasify(language);
-  // log << "Top level language: " << lowercase << std::endl;
-  std::unordered_map<std::string, SubstitutableString> intermap;
-  LoadLanguage(language, intermap);
-  if(key_internment) {
-    delete[] key_internment;
-    key_internment = nullptr;
+bool Context::Superseded(uint32_t serial) const {
+  return serial != 0 && serial != language_request_serial.load();
+}
+
+std::shared_ptr<LoadedLanguage>
+Context::TakeCachedLanguage(LanguageTag language) {
+  if(language_cache_budget == 0) return nullptr;
+  if(current->code == language && !current->external
+     && current->source_generation == source_generation)
+    return current;
+  for(auto it = language_cache.begin(); it != language_cache.end(); ++it) {
+    if((*it)->code == language
+       && (*it)->source_generation == source_generation) {
+      auto ret = std::move(*it);
+      language_cache.erase(it);
+      return ret;
+    }
   }
-  size_t intern_length = 0;
-  for(auto& pair : intermap) {
-    intern_length += pair.first.length();
+  return nullptr;
+}
+
+std::shared_ptr<LoadedLanguage>
+Context::BuildLanguage(LanguageTag language, uint32_t serial) {
+  // log << "Top level language: " << language.GetCode() << std::endl;
+  std::unordered_map<std::string, SubstitutableString> intermap;
+  std::unique_ptr<LoadedLanguage::LazyGroups> lazy;
+  if(lazy_groups)
+    lazy.reset(new LoadedLanguage::LazyGroups(language, compact_storage));
+  LoadLanguage(language, intermap, serial, lazy.get());
+  if(Superseded(serial)) return nullptr;
+  auto ret = std::make_shared<LoadedLanguage>(language, source_generation);
+  std::vector<const LoadedLanguage*> donors;
+  donors.push_back(current.get());
+  for(auto& lang : language_cache) donors.push_back(lang.get());
+  ret->Build(intermap, compact_storage, donors, hot_keys);
+  if(lazy && !lazy->Empty()) {
+    lazy->Freeze();
+    ret->lazy = std::move(lazy);
   }
-  if(intern_length != 0) {
-    auto p = new char[intern_length];
-    key_internment = p;
-    for(auto& pair : intermap) {
-      memcpy(p, pair.first.data(), pair.first.length());
-      loaded_keys.emplace(ConstKey(p, pair.first.length()),
-                          std::move(pair.second));
-      p += pair.first.length();
+  return ret;
+}
+
+void Context::SwitchLanguage(std::shared_ptr<LoadedLanguage> next) {
+  if(next == current) return;
+  if(key_profiling) StartCounting(*next);
+  // (atomically, since rendering into a SegmentSink reads current without
+  // load_mutex)
+  std::shared_ptr<LoadedLanguage> outgoing
+    = std::atomic_exchange(&current, std::move(next));
+  if(key_profiling)
+    outgoing->counting.store(nullptr, std::memory_order_release);
+  live.store(current.get());
+  // Any render that can still see outgoing registered itself before we
+  // stored live, so its count is visible now. Drain the counters one epoch
+  // at a time; renders starting from here on count against the other epoch,
+  // so neither wait can be starved.
+  for(int flip = 0; flip < 2; ++flip) {
+    unsigned int epoch = reader_epoch.fetch_xor(1) & 1;
+    for(auto& stripe : reader_stripes) {
+      while(stripe.count[epoch].load() != 0)
+        std::this_thread::yield();
     }
   }
+  if(language_cache_budget != 0 && outgoing->HasMessages()
+     && !outgoing->external
+     && outgoing->source_generation == source_generation) {
+    language_cache.emplace_front(std::move(outgoing));
+    TrimLanguageCache();
+  }
+}
+
+Context& Context::SetLanguage(const std::string& language) {
+  // abandon any background load
+  ++language_request_serial;
+  std::lock_guard<std::mutex> lock(load_mutex);
+  MaybeGetLanguageList();
+  LanguageTag tag = LanguageTag::Get(language);
+  auto next = TakeCachedLanguage(tag);
+  // (the old language stays live until the new one is built, so renders on
+  // other threads never see it half gone)
+  if(!next) next = BuildLanguage(tag, 0);
+  SwitchLanguage(std::move(next));
   return *this;
 }
 
-const SubstitutableString* Context::Lookup(const Key& _key) {
-  // OH GOD
-  const ConstKey& key = reinterpret_cast<const ConstKey&>(_key);
-  auto lkit = loaded_keys.find(key);
-  if(lkit == loaded_keys.end()) return nullptr;
-  else return &lkit->second;
+std::future<bool> Context::SetLanguageAsync(const std::string& language) {
+  std::promise<bool> promise;
+  std::future<bool> ret = promise.get_future();
+  std::lock_guard<std::mutex> lock(loader_mutex);
+  if(loader_has_request) loader_request_promise.set_value(false);
+  uint32_t serial;
+  // (zero means "never give up")
+  do serial = ++language_request_serial; while(serial == 0);
+  loader_has_request = true;
+  loader_request = LanguageTag::Get(language);
+  loader_request_serial = serial;
+  loader_request_promise = std::move(promise);
+  if(!loader_thread.joinable())
+    loader_thread = std::thread(&Context::LoaderThreadMain, this);
+  loader_cond.notify_one();
+  return ret;
+}
+
+void Context::LoaderThreadMain() {
+  std::unique_lock<std::mutex> lock(loader_mutex);
+  while(true) {
+    loader_cond.wait(lock, [this]() {
+        return loader_stopping || loader_has_request;
+      });
+    if(loader_stopping) break;
+    LanguageTag language = loader_request;
+    uint32_t serial = loader_request_serial;
+    std::promise<bool> promise = std::move(loader_request_promise);
+    loader_has_request = false;
+    lock.unlock();
+    bool switched = false;
+    {
+      std::lock_guard<std::mutex> load_lock(load_mutex);
+      if(!Superseded(serial)) {
+        MaybeGetLanguageList();
+        auto next = TakeCachedLanguage(language);
+        if(!next) next = BuildLanguage(language, serial);
+        if(next) {
+          SwitchLanguage(std::move(next));
+          switched = true;
+        }
+      }
+    }
+    promise.set_value(switched);
+    lock.lock();
+  }
+}
+
+const SubstitutableString* Context::Lookup(const Key& key) {
+  return live.load()->Find(key);
+}
+
+const SubstitutableString* Context::Lookup(const MessageHandle& handle) {
+  return live.load()->Find(handle);
+}
+
+void Context::LookupMany(const ConstKey* keys, size_t count,
+                         const SubstitutableString** out) {
+  live.load()->FindMany(keys, count, out);
+}
+
+void Context::LookupMany(const DynamicKey* keys, size_t count,
+                         const SubstitutableString** out) {
+  live.load()->FindMany(keys, count, out);
+}
+
+void DynamicKey::GrowAndAppend(const char* piece, size_t len) {
+  size_t new_capacity = std::max(capacity * 2, name_len + len);
+  char* buffer = new char[new_capacity];
+  memcpy(buffer, name, name_len);
+  // (piece might be part of our own name, so copy it before freeing that)
+  memcpy(buffer + name_len, piece, len);
+  Release();
+  name = buffer;
+  capacity = new_capacity;
+}
+
+DynamicKey& DynamicKey::AppendInteger(unsigned long long magnitude,
+                                      bool negative) {
+  char digits[24];
+  char* p = digits + sizeof(digits);
+  do {
+    *--p = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while(magnitude != 0);
+  if(negative) *--p = '-';
+  return Append(p, digits + sizeof(digits) - p);
 }
 
 std::string Context::Get(const Key& key,
                          std::initializer_list<std::string> args) {
-  std::ostringstream ret;
-  Out(ret, key, args);
-  return ret.str();
+  return Get(key, std::vector<std::string>(args));
 }
 
 std::string Context::Get(const Key& key,
                          const std::vector<std::string>& args) {
-  std::ostringstream ret;
-  Out(ret, key, args);
-  return ret.str();
+  std::string ret;
+  StringSink sink(ret);
+  Render(sink, key, args);
+  return ret;
 }
 
 void Context::Out(std::ostream& out, const Key& key,
@@ -482,17 +1691,95 @@ void Context::Out(std::ostream& out, const Key& key,
 
 void Context::Out(std::ostream& out, const Key& key,
                   const std::vector<std::string>& args) {
-  static const ConstKey MISSING_KEY_KEY = "__MISSING_KEY__"_Key;
-  const SubstitutableString* p = Lookup(key);
-  if(!p) {
-    log << "SN: Missing key: " << key.AsString() << std::endl;
-    auto str = key.AsString();
-    std::vector<std::string> fake_args{str};
-    p = Lookup(MISSING_KEY_KEY);
-    if(!p) p = &NO_SUCH_KEY;
-    (*p)(*this, out, fake_args);
+  OstreamSink sink(out);
+  Render(sink, key, args);
+}
+
+std::string Context::Get(const MessageHandle& handle,
+                         std::initializer_list<std::string> args) {
+  return Get(handle, std::vector<std::string>(args));
+}
+
+std::string Context::Get(const MessageHandle& handle,
+                         const std::vector<std::string>& args) {
+  std::string ret;
+  StringSink sink(ret);
+  Render(sink, handle, args);
+  return ret;
+}
+
+void Context::Out(std::ostream& out, const MessageHandle& handle,
+                  std::initializer_list<std::string> args) {
+  Out(out, handle, std::vector<std::string>(args));
+}
+
+void Context::Out(std::ostream& out, const MessageHandle& handle,
+                  const std::vector<std::string>& args) {
+  OstreamSink sink(out);
+  Render(sink, handle, args);
+}
+
+void Context::Render(SegmentSink& sink, const Key& key,
+                     const std::vector<std::string>& args) {
+  // (pinning the language this way costs more than a Reader, but lets it
+  // outlive the call)
+  std::shared_ptr<const LoadedLanguage> lang = std::atomic_load(&current);
+  if(sink.languages.empty() || sink.languages.back() != lang)
+    sink.languages.push_back(lang);
+  RenderLookedUp(*lang, sink, key, lang->Find(key), args);
+}
+
+void Context::Render(SegmentSink& sink, const MessageHandle& handle,
+                     const std::vector<std::string>& args) {
+  std::shared_ptr<const LoadedLanguage> lang = std::atomic_load(&current);
+  if(sink.languages.empty() || sink.languages.back() != lang)
+    sink.languages.push_back(lang);
+  RenderLookedUp(*lang, sink, handle.GetKey(), lang->Find(handle), args);
+}
+
+void Context::RenderLookedUp(const LoadedLanguage& lang, SegmentSink& sink,
+                             const Key& key, const SubstitutableString* p,
+                             const std::vector<std::string>& args) {
+  if(p) p->Render(*this, lang, sink, args);
+  else {
+    sink.missing_key_args.emplace_back(1, key.AsString());
+    GetMissingKeyMessage(lang, key).Render(*this, lang, sink,
+                                           sink.missing_key_args.back());
   }
-  else (*p)(*this, out, args);
+}
+
+void Context::GetMany(const ConstKey* keys, size_t count, std::string* out,
+                      const std::vector<std::string>* args) {
+  GetManyOf(keys, count, out, args);
+}
+
+void Context::GetMany(const DynamicKey* keys, size_t count, std::string* out,
+                      const std::vector<std::string>* args) {
+  GetManyOf(keys, count, out, args);
+}
+
+template<class K>
+void Context::GetManyOf(const K* keys, size_t count, std::string* out,
+                        const std::vector<std::string>* args) {
+  static const std::vector<std::string> no_args;
+  std::vector<const SubstitutableString*> found(count);
+  Reader reader(*this);
+  reader.lang->FindMany(keys, count, found.data());
+  for(size_t n = 0; n < count; ++n) {
+    out[n].clear();
+    StringSink sink(out[n]);
+    RenderLookedUp(*reader.lang, sink, keys[n], found[n],
+                   args ? args[n] : no_args);
+  }
+}
+
+const SubstitutableString&
+Context::GetMissingKeyMessage(const LoadedLanguage& lang, const Key& key) {
+  static const ConstKey MISSING_KEY_KEY = "__MISSING_KEY__"_Key;
+  LogMessage(*this) << "SN: Missing key: " << key.AsString() << std::endl;
+  const SubstitutableString* p = lang.Find(MISSING_KEY_KEY);
+  if(!p) p = &NO_SUCH_KEY;
+  return *p;
 }
 
 namespace match {
@@ -545,7 +1832,7 @@ namespace match {
     int count = 0;
     while(count <= max && it != end) {
       if((*it >= 'A' && *it <= 'Z') || (*it >= 'a' && *it <= 'z')
-         || (*it >= '9' && *it <= '9')) {
+         || (*it >= '0' && *it <= '9')) {
         ++it;
         ++count;
       }
@@ -600,8 +1887,10 @@ namespace match {
   static bool digit_prefix_alphanum(std::string::const_iterator& begin,
                                     const std::string::const_iterator& end,
                                     int min = 1, int max = 1) {
-    auto it = begin;
-    if(digit(it, end) && alphanum(it, end, min-1, max-1)) {
+    // (not digit(), which would swallow any digits that follow)
+    if(begin == end || *begin < '0' || *begin > '9') return false;
+    auto it = begin + 1;
+    if(alphanum(it, end, min-1, max-1)) {
       begin = it;
       return true;
     }
@@ -739,3 +2028,107 @@ bool SN::SimpleFallback(const std::string& code, std::string& to) {
     }
   }
 }
+
+static std::mutex& get_language_tag_mutex() {
+  // (function-local, so that tags can be made during static initialization)
+  static std::mutex mutex;
+  return mutex;
+}
+
+static const std::string EMPTY_STRING;
+
+LanguageTag LanguageTag::Get(const std::string& code) {
+  std::string lowercase = lowercasify(code);
+  std::lock_guard<std::mutex> lock(get_language_tag_mutex());
+  return LanguageTag(InternLocked(lowercase));
+}
+
+const LanguageTag::Data*
+LanguageTag::InternLocked(const std::string& lowercase) {
+  // Invalid codes aren't remembered, only valid ones.
+  static std::unordered_map<std::string, std::unique_ptr<Data> > tags;
+  auto it = tags.find(lowercase);
+  if(it != tags.end()) return it->second.get();
+  if(!IsValidLanguageCode(lowercase)) return nullptr;
+  std::unique_ptr<Data> data(new Data);
+  data->code = lowercase;
+  data->lowercase = lowercase;
+  data->script_offset = data->script_length = 0;
+  data->region_offset = data->region_length = 0;
+  // The code is already known to be valid, so the subtags can be told apart
+  // by their lengths and first characters alone.
+  size_t length = lowercase.length();
+  auto subtag_end = [&lowercase, length](size_t pos) {
+    size_t ret = lowercase.find('-', pos);
+    return ret == std::string::npos ? length : ret;
+  };
+  size_t pos = subtag_end(0);
+  if(lowercase[0] == 'x' && pos == 1) {
+    // private use code; all of it is "language"
+    pos = length;
+  }
+  else if(pos <= 3) {
+    // up to three 3-letter extended language subtags
+    for(int n = 0; n < 3 && pos != length; ++n) {
+      size_t next = subtag_end(pos + 1);
+      if(next - pos != 4 || lowercase[pos+1] < 'a' || lowercase[pos+1] > 'z')
+        break;
+      pos = next;
+    }
+  }
+  data->language_length = pos;
+  if(pos != length) {
+    // optional script tag
+    size_t next = subtag_end(pos + 1);
+    if(next - pos == 5 && lowercase[pos+1] >= 'a' && lowercase[pos+1] <= 'z') {
+      data->script_offset = pos + 1;
+      data->script_length = 4;
+      data->code[pos+1] &= ~0x20;
+      pos = next;
+    }
+  }
+  if(pos != length) {
+    // optional region tag
+    size_t next = subtag_end(pos + 1);
+    if(next - pos == 3 || (next - pos == 4 && lowercase[pos+1] >= '0'
+                           && lowercase[pos+1] <= '9')) {
+      data->region_offset = pos + 1;
+      data->region_length = next - pos - 1;
+      for(size_t n = pos + 1; n < next; ++n) {
+        if(data->code[n] >= 'a' && data->code[n] <= 'z')
+          data->code[n] &= ~0x20;
+      }
+    }
+  }
+  std::string fallback;
+  if(SimpleFallback(lowercase, fallback))
+    data->simple_fallback = InternLocked(fallback);
+  else
+    data->simple_fallback = nullptr;
+  const Data* ret = data.get();
+  tags.emplace(lowercase, std::move(data));
+  return ret;
+}
+
+const std::string& LanguageTag::GetCode() const {
+  return data ? data->code : EMPTY_STRING;
+}
+
+const std::string& LanguageTag::GetLowercase() const {
+  return data ? data->lowercase : EMPTY_STRING;
+}
+
+std::string LanguageTag::GetLanguage() const {
+  if(!data) return std::string();
+  return data->code.substr(0, data->language_length);
+}
+
+std::string LanguageTag::GetScript() const {
+  if(!data) return std::string();
+  return data->code.substr(data->script_offset, data->script_length);
+}
+
+std::string LanguageTag::GetRegion() const {
+  if(!data) return std::string();
+  return data->code.substr(data->region_offset, data->region_length);
+}
@@ -0,0 +1,30 @@
+#include "sn.hh"
+
+#include <errno.h>
+#include <unistd.h>
+
+SN::FdSink::FdSink(int fd) : fd(fd), failed(false), used(0) {}
+
+SN::FdSink::~FdSink() {
+  Flush();
+}
+
+void SN::FdSink::WriteDirect(const char* data, size_t length) {
+  while(length > 0 && !failed) {
+    ssize_t written = write(fd, data, length);
+    if(written < 0) {
+      if(errno == EINTR) continue;
+      failed = true;
+    }
+    else {
+      data += written;
+      length -= written;
+    }
+  }
+}
+
+bool SN::FdSink::Flush() {
+  WriteDirect(buffer, used);
+  used = 0;
+  return !failed;
+}
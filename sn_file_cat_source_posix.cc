@@ -1,7 +1,318 @@
 #include "sn.hh"
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <fstream>
+#include <streambuf>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define SN_IO_URING 1
+#endif
+#endif
+#endif
+
+// Cats bigger than this aren't fetched whole, but left to OpenCat (as are
+// any that don't fit in the budget)
+static const size_t MAX_FETCHED_CAT = 16 * 1024 * 1024;
+
+// how many threads read a batch when io_uring can't
+static const size_t FETCH_THREADS = 4;
+
+// A cat that has been read into memory
+class FetchedCat : public std::istream {
+  class Buffer : public std::streambuf {
+    std::unique_ptr<char[]> data;
+  public:
+    Buffer(std::unique_ptr<char[]> data, size_t size) : data(std::move(data)) {
+      setg(this->data.get(), this->data.get(), this->data.get() + size);
+    }
+  protected:
+    pos_type seekoff(off_type off, std::ios::seekdir dir,
+                     std::ios::openmode which) override {
+      off_type pos = off;
+      if(dir == std::ios::cur) pos += gptr() - eback();
+      else if(dir == std::ios::end) pos += egptr() - eback();
+      if(!(which & std::ios::in) || pos < 0 || pos > egptr() - eback())
+        return pos_type(off_type(-1));
+      setg(eback(), eback() + pos, egptr());
+      return pos_type(pos);
+    }
+    pos_type seekpos(pos_type pos, std::ios::openmode which) override {
+      return seekoff(off_type(pos), std::ios::beg, which);
+    }
+  } buffer;
+public:
+  FetchedCat(std::unique_ptr<char[]> data, size_t size)
+    : std::istream(nullptr), buffer(std::move(data), size) {
+    rdbuf(&buffer);
+  }
+};
+
+// The cats from one FetchCats call that are being read whole. Every cat's
+// future holds on to this until it has been waited on.
+class CatBatch {
+  struct Cat {
+    int fd;
+    std::unique_ptr<char[]> data;
+    size_t size, done;
+    bool finished, failed;
+    struct iovec iov;
+  };
+  std::vector<Cat> cats;
+  std::mutex mutex;
+  std::condition_variable cat_finished;
+#if SN_IO_URING
+  int ring_fd;
+  void* sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+  struct io_uring_sqe* sqes;
+  unsigned* sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned* cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe* cqes;
+  unsigned sq_entries;
+  size_t in_flight;
+  // cats whose next read hasn't been submitted yet, the next one last
+  std::vector<size_t> to_submit;
+  bool StartRing();
+  void Submit();
+  void Reap(bool wait);
+#endif
+  // (only used if there's no ring; these must go before cats does)
+  std::atomic<size_t> next_read;
+  std::vector<std::future<void> > readers;
+  void Finish(Cat& cat, bool failed);
+  void ReadOnThreads();
+public:
+  CatBatch() :
+#if SN_IO_URING
+    ring_fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes(nullptr),
+    in_flight(0),
+#endif
+    next_read(0) {}
+  ~CatBatch();
+  // Takes ownership of fd. Returns the cat's index.
+  size_t Add(int fd, size_t size);
+  size_t Size() const { return cats.size(); }
+  void Start();
+  // Returns nullptr if the cat couldn't be read
+  std::unique_ptr<std::istream> Wait(size_t index);
+};
+
+void CatBatch::Finish(Cat& cat, bool failed) {
+  cat.finished = true;
+  cat.failed = failed;
+  close(cat.fd);
+  cat.fd = -1;
+}
+
+size_t CatBatch::Add(int fd, size_t size) {
+  Cat cat;
+  cat.fd = fd;
+  // (an empty cat still gets a buffer, since FetchedCat needs one)
+  cat.data.reset(new char[std::max<size_t>(size, 1)]);
+  cat.size = size;
+  cat.done = 0;
+  cat.finished = false;
+  cat.failed = false;
+  cat.iov.iov_base = nullptr;
+  cat.iov.iov_len = 0;
+  cats.push_back(std::move(cat));
+  if(size == 0) Finish(cats.back(), false);
+  return cats.size() - 1;
+}
+
+void CatBatch::ReadOnThreads() {
+  size_t n;
+  while((n = next_read++) < cats.size()) {
+    Cat& cat = cats[n];
+    if(cat.finished) continue;
+    bool failed = false;
+    while(cat.done < cat.size) {
+      ssize_t red = pread(cat.fd, cat.data.get() + cat.done,
+                          cat.size - cat.done, cat.done);
+      if(red < 0 && errno == EINTR) continue;
+      if(red < 0) failed = true;
+      // (a cat that shrank underneath us just ends early)
+      if(red <= 0) break;
+      cat.done += red;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    cat.size = cat.done;
+    Finish(cat, failed);
+    cat_finished.notify_all();
+  }
+}
+
+#if SN_IO_URING
+bool CatBatch::StartRing() {
+  unsigned entries = 1;
+  while(entries < cats.size() && entries < 64) entries *= 2;
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  // (ENOSYS on old kernels, EPERM where it has been turned off)
+  if(ring_fd < 0) return false;
+  sq_entries = params.sq_entries;
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes
+    + params.cq_entries * sizeof(struct io_uring_cqe);
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if(sq_ring == MAP_FAILED) return false;
+  cq_ring = mmap(nullptr, cq_ring_size, PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  if(cq_ring == MAP_FAILED) return false;
+  void* p = mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd,
+                 IORING_OFF_SQES);
+  if(p == MAP_FAILED) return false;
+  sqes = static_cast<struct io_uring_sqe*>(p);
+  char* sq = static_cast<char*>(sq_ring);
+  sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  char* cq = static_cast<char*>(cq_ring);
+  cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+  for(size_t n = cats.size(); n-- > 0;)
+    if(!cats[n].finished) to_submit.push_back(n);
+  return true;
+}
+
+// Queues reads for as many cats as there's room for (in the ring, and in the
+// completion queue, which is at least as big), and submits them
+void CatBatch::Submit() {
+  unsigned tail = *sq_tail;
+  unsigned queued = 0;
+  while(in_flight + queued < sq_entries && !to_submit.empty()) {
+    Cat& cat = cats[to_submit.back()];
+    to_submit.pop_back();
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    // (READV rather than READ, since it goes back to the first kernels
+    // with io_uring)
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = cat.fd;
+    cat.iov.iov_base = cat.data.get() + cat.done;
+    cat.iov.iov_len = cat.size - cat.done;
+    sqe->addr = reinterpret_cast<uintptr_t>(&cat.iov);
+    sqe->len = 1;
+    sqe->off = cat.done;
+    sqe->user_data = &cat - cats.data();
+    sq_array[index] = index;
+    ++tail;
+    ++queued;
+  }
+  if(queued == 0) return;
+  __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+  while(queued > 0) {
+    int submitted = syscall(__NR_io_uring_enter, ring_fd, queued, 0, 0,
+                            nullptr, 0);
+    if(submitted < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+    if(submitted <= 0) {
+      // Take back what the kernel didn't take, and let whoever waits for
+      // those cats fall back to OpenCat
+      unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+      for(unsigned n = head; n != tail; ++n)
+        Finish(cats[sqes[sq_array[n & *sq_mask]].user_data], true);
+      __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+      break;
+    }
+    queued -= submitted;
+    in_flight += submitted;
+  }
+}
+
+// Handles every completion that has arrived, first waiting for at least one
+// if wait is true
+void CatBatch::Reap(bool wait) {
+  if(wait) {
+    while(syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS,
+                  nullptr, 0) < 0 && errno == EINTR)
+      {}
+  }
+  unsigned head = *cq_head;
+  unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  for(; head != tail; ++head) {
+    struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+    Cat& cat = cats[cqe->user_data];
+    --in_flight;
+    if(cqe->res > 0) cat.done += cqe->res;
+    if(cqe->res == -EINTR || cqe->res == -EAGAIN
+       || (cqe->res > 0 && cat.done < cat.size)) {
+      // short read; go around again for the rest
+      to_submit.push_back(cqe->user_data);
+      continue;
+    }
+    cat.size = cat.done;
+    Finish(cat, cqe->res < 0);
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  if(!to_submit.empty()) Submit();
+}
+#endif
+
+void CatBatch::Start() {
+#if SN_IO_URING
+  if(StartRing()) {
+    Submit();
+    return;
+  }
+#endif
+  size_t threads = std::min(FETCH_THREADS, cats.size());
+  for(size_t n = 0; n < threads; ++n)
+    readers.push_back(std::async(std::launch::async,
+                                 &CatBatch::ReadOnThreads, this));
+}
+
+std::unique_ptr<std::istream> CatBatch::Wait(size_t index) {
+  std::unique_lock<std::mutex> lock(mutex);
+  Cat& cat = cats[index];
+  while(!cat.finished) {
+#if SN_IO_URING
+    if(ring_fd >= 0) {
+      // Nobody else reaps, so we have to. (Whichever cat finishes first,
+      // parsing can't start until this one has.)
+      Reap(in_flight != 0);
+      continue;
+    }
+#endif
+    cat_finished.wait(lock);
+  }
+  if(cat.failed || !cat.data) return nullptr;
+  return std::make_unique<FetchedCat>(std::move(cat.data), cat.size);
+}
+
+CatBatch::~CatBatch() {
+  // The kernel may still be writing into the buffers of cats nobody waited
+  // for
+#if SN_IO_URING
+  if(ring_fd >= 0) {
+    to_submit.clear();
+    while(in_flight != 0) Reap(true);
+  }
+  if(sqes) munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+  if(cq_ring != MAP_FAILED) munmap(cq_ring, cq_ring_size);
+  if(sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+  if(ring_fd >= 0) close(ring_fd);
+#endif
+  for(auto& reader : readers) reader.get();
+  for(auto& cat : cats)
+    if(cat.fd >= 0) close(cat.fd);
+}
 
 SN::FileCatSource::FileCatSource(const std::string& basepath,
                                  const std::string& suffix)
@@ -48,22 +359,60 @@ SN::FileCatSource::GetAvailableCats(std::function<void(std::string)> func) {
         if(c == '-') continue;
         else if(c == '_') c = '-';
       }
-      if(SN::IsValidLanguageCode(code)) func(std::move(code));
+      if(SN::LanguageTag::Get(code).IsValid()) func(std::move(code));
     }
     closedir(d);
   }
 }
 
-std::unique_ptr<std::istream>
-SN::FileCatSource::OpenCat(const std::string& cat) {
+std::string SN::FileCatSource::GetPath(const std::string& cat) const {
   std::string code(cat);
   for(auto& c : code)
     if(c == '-') c = '_';
   std::string path;
   path.reserve(dirpath_plus_prefix.length() + code.length() + suffix.length());
   ((path += dirpath_plus_prefix) += code) += suffix;
+  return path;
+}
+
+std::unique_ptr<std::istream>
+SN::FileCatSource::OpenCat(const std::string& cat) {
   auto ret = std::make_unique<std::fstream>
-    (path, std::ios::binary|std::ios::in);
+    (GetPath(cat), std::ios::binary|std::ios::in);
   if(!ret->good()) return nullptr;
   else return ret;
 }
+
+std::vector<std::future<std::unique_ptr<std::istream> > >
+SN::FileCatSource::FetchCats(const std::vector<std::string>& cats,
+                             size_t& budget) {
+  std::vector<std::future<std::unique_ptr<std::istream> > > ret;
+  ret.reserve(cats.size());
+  auto batch = std::make_shared<CatBatch>();
+  for(auto& cat : cats) {
+    int fd = open(GetPath(cat).c_str(), O_RDONLY|O_CLOEXEC);
+    struct stat st;
+    if(fd >= 0 && (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+                   || size_t(st.st_size) > MAX_FETCHED_CAT
+                   || size_t(st.st_size) > budget)) {
+      close(fd);
+      fd = -1;
+    }
+    if(fd < 0) {
+      // (including cats that don't exist, which OpenCat will say again)
+      ret.push_back(std::async(std::launch::deferred,
+                               [this, cat]() { return OpenCat(cat); }));
+      continue;
+    }
+    budget -= st.st_size;
+    size_t index = batch->Add(fd, st.st_size);
+    // If the cat couldn't be read whole after all, OpenCat gets a turn
+    ret.push_back(std::async(std::launch::deferred,
+                             [this, cat, batch, index]() {
+                               auto ret = batch->Wait(index);
+                               return ret ? std::move(ret) : OpenCat(cat);
+                             }));
+  }
+  if(batch->Size() != 0) batch->Start();
+  return ret;
+}
@@ -2,21 +2,18 @@
 
 #include <array>
 
-// assumes already lowercase
-bool SN::Context::AcceptableLanguage(const std::string& language) {
-  auto it = langinfo.find(language);
-  if(it != langinfo.end()) return true;
-  std::string fallback_code;
-  if(SN::SimpleFallback(language, fallback_code))
-    return AcceptableLanguage(fallback_code);
-  else
-    return false;
+bool SN::Context::AcceptableLanguage(LanguageTag language) {
+  for(; language.IsValid(); language = language.GetSimpleFallback()) {
+    if(langinfo.find(language) != langinfo.end()) return true;
+  }
+  return false;
 }
 
 static const std::array<const char*, 5> LOCALE_VARS
 {{"LANG","LANGSPEC","LANGUAGE","LC_MESSAGES","LC_ALL"}};
 
 std::string SN::Context::GetSystemLanguage(const std::string& default_choice) {
+  std::lock_guard<std::mutex> lock(load_mutex);
   MaybeGetLanguageList();
   // TODO: on Windows, use GetUserPreferredUILanguages
   for(const char* env : LOCALE_VARS) {
@@ -34,7 +31,7 @@ std::string SN::Context::GetSystemLanguage(const std::string& default_choice) {
           *it++ |= 0x20;
         else ++it;
       }
-      if(SN::IsValidLanguageCode(code) && AcceptableLanguage(code))
+      if(AcceptableLanguage(SN::LanguageTag::Get(code)))
         return code;
     }
   }
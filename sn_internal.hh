@@ -0,0 +1,34 @@
+#ifndef SNINTERNALHH
+#define SNINTERNALHH
+
+// Things the library's source files share with each other, but not with the
+// library's users. Don't include this yourself.
+
+#include "sn.hh"
+
+namespace SN {
+  // MessageHandle's index for "this key is missing", and an empty table
+  // slot's message
+  static const uint32_t NO_MESSAGE = 0xFFFFFFFFU;
+  // Packed blocks start on this boundary in the arena, since they begin with
+  // their code (which is int32_t).
+  static const size_t PACKED_BLOCK_ALIGNMENT = 4;
+  inline size_t align_up(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+  }
+  // All of our hash tables are open-addressed, with 1<<(32-shift) slots, and
+  // start probing at the slot this picks. (Fibonacci hashing, to mix the high
+  // bits of the hash in.)
+  inline uint32_t home_slot(uint32_t hash, unsigned int shift) {
+    return (hash * 0x9E3779B9U) >> shift;
+  }
+  // returns the shift for the smallest such table with at least min_slots
+  // slots (and at least two)
+  inline unsigned int get_table_shift(size_t min_slots) {
+    unsigned int bits = 1;
+    while((size_t(1) << bits) < min_slots) ++bits;
+    return 32 - bits;
+  }
+}
+
+#endif
@@ -0,0 +1,229 @@
+#include "sn_internal.hh"
+
+#include <algorithm>
+#include <unordered_set>
+
+// ranges longer than this can't match anything we have, so don't try
+static const size_t MAX_RANGE_LENGTH = 64;
+
+static inline bool all_alpha(const char* p, size_t n) {
+  while(n-- > 0) {
+    if(!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'))) return false;
+    ++p;
+  }
+  return true;
+}
+
+static inline bool all_digit(const char* p, size_t n) {
+  while(n-- > 0) {
+    if(*p < '0' || *p > '9') return false;
+    ++p;
+  }
+  return true;
+}
+
+static inline size_t subtag_length(const char* p, const char* end) {
+  const char* q = p;
+  while(q != end && *q != '-') ++q;
+  return q - p;
+}
+
+// Does what SN::SimpleFallback does, but in place, and without allocating.
+// (Header text isn't made into LanguageTags, since interned tags are never
+// freed.)
+static bool simple_fallback(char* code, size_t& length) {
+  const char* end = code + length;
+  const char* p = code;
+  size_t n = subtag_length(p, end);
+  if(n < 2 || n > 8 || !all_alpha(p, n)) return false;
+  p += n;
+  if(n <= 3) {
+    // ISO 639 codes may be followed by up to three 3-letter extended
+    // language subtags
+    for(int i = 0; i < 3 && p != end; ++i) {
+      n = subtag_length(p + 1, end);
+      if(n != 3 || !all_alpha(p + 1, n)) break;
+      p += 1 + n;
+    }
+  }
+  size_t language_length = p - code;
+  // Optional script tag
+  bool script = false;
+  if(p != end) {
+    n = subtag_length(p + 1, end);
+    if(n == 4 && all_alpha(p + 1, n)) {
+      script = true;
+      p += 1 + n;
+    }
+  }
+  // Optional region tag
+  const char* region = nullptr;
+  size_t region_length = 0;
+  if(p != end) {
+    n = subtag_length(p + 1, end);
+    if((n == 2 && all_alpha(p + 1, n)) || (n == 3 && all_digit(p + 1, n))) {
+      region = p + 1;
+      region_length = n;
+      p += 1 + n;
+    }
+  }
+  if(p != end) {
+    // language code had optional tags, strip them
+    length = p - code;
+    return true;
+  }
+  else if(script) {
+    if(region) {
+      memmove(code + language_length + 1, region, region_length);
+      length = language_length + 1 + region_length;
+    }
+    else length = language_length;
+    return true;
+  }
+  else if(region) {
+    length = language_length;
+    return true;
+  }
+  else return false;
+}
+
+// Parses a qvalue ("0", "0.5", "1.000"...) into thousandths
+static int parse_qvalue(const char*& p, const char* end) {
+  if(p == end || *p < '0' || *p > '1') return 0;
+  int ret = (*p++ - '0') * 1000;
+  if(p != end && *p == '.') {
+    ++p;
+    int scale = 100;
+    while(p != end && *p >= '0' && *p <= '9') {
+      ret += (*p++ - '0') * scale;
+      scale /= 10;
+    }
+  }
+  return std::min(ret, 1000);
+}
+
+// Maps lowercase language codes to the available languages they match: each
+// available language's own code, and then every code in its SimpleFallback
+// chain that isn't itself available.
+class SN::Context::NegotiationTable {
+  struct Entry {
+    std::string lowercase;
+    uint32_t hash;
+    uint32_t code; // index into codes
+  };
+  std::vector<std::string> codes;
+  std::vector<Entry> entries;
+  // open-addressed (linear probing); indices into entries, -1 if empty
+  std::vector<int32_t> slots;
+  unsigned int shift;
+  void Add(const std::string& lowercase, uint32_t code) {
+    entries.push_back(Entry{lowercase,
+                            Key::CalculateHash(lowercase.cbegin(),
+                                               lowercase.cend()),
+                            code});
+  }
+public:
+  NegotiationTable(std::unordered_map<LanguageTag, LangInfo,
+                                      LanguageTag::Hash>& langinfo) {
+    std::vector<std::pair<LanguageTag, std::string> > available;
+    for(auto& pair : langinfo)
+      available.emplace_back(pair.first, pair.second.GetCode());
+    // (sorted, so that shared fallbacks go to the same language every time)
+    std::sort(available.begin(), available.end(),
+              [](const std::pair<LanguageTag, std::string>& a,
+                 const std::pair<LanguageTag, std::string>& b) {
+                return a.first.GetLowercase() < b.first.GetLowercase();
+              });
+    std::unordered_set<LanguageTag, LanguageTag::Hash> seen;
+    for(auto& pair : available) {
+      seen.insert(pair.first);
+      Add(pair.first.GetLowercase(), codes.size());
+      codes.push_back(pair.second);
+    }
+    for(uint32_t n = 0; n < available.size(); ++n) {
+      for(LanguageTag fallback = available[n].first.GetSimpleFallback();
+          fallback.IsValid(); fallback = fallback.GetSimpleFallback()) {
+        if(seen.insert(fallback).second) Add(fallback.GetLowercase(), n);
+      }
+    }
+    // keep the table at most half full
+    shift = get_table_shift(entries.size() * 2);
+    slots.resize(size_t(1) << (32 - shift), -1);
+    for(uint32_t n = 0; n < entries.size(); ++n) {
+      uint32_t i = home_slot(entries[n].hash, shift);
+      while(slots[i] >= 0) i = (i + 1) & (slots.size() - 1);
+      slots[i] = n;
+    }
+  }
+  // returns nullptr if nothing matches
+  const std::string* Find(const char* lowercase, size_t length) const {
+    uint32_t hash = Key::CalculateHash(lowercase, lowercase + length);
+    uint32_t i = home_slot(hash, shift);
+    while(slots[i] >= 0) {
+      auto& entry = entries[slots[i]];
+      if(entry.hash == hash && entry.lowercase.length() == length
+         && !memcmp(entry.lowercase.data(), lowercase, length))
+        return &codes[entry.code];
+      i = (i + 1) & (slots.size() - 1);
+    }
+    return nullptr;
+  }
+};
+
+std::string SN::Context::Negotiate(const char* header, size_t length,
+                                   const std::string& default_choice) {
+  const NegotiationTable* table = negotiation_table.load();
+  if(!table) {
+    std::lock_guard<std::mutex> lock(load_mutex);
+    table = negotiation_table.load();
+    if(!table) {
+      MaybeGetLanguageList();
+      auto built = std::make_shared<const NegotiationTable>(langinfo);
+      negotiation_tables.push_back(built);
+      table = built.get();
+      negotiation_table = table;
+    }
+  }
+  const std::string* best = nullptr;
+  int best_q = 0;
+  const char* p = header;
+  const char* end = header + length;
+  while(p != end) {
+    while(p != end && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+    if(p == end) break;
+    char range[MAX_RANGE_LENGTH];
+    size_t range_length = 0;
+    bool too_long = false;
+    while(p != end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+      char c = *p++;
+      if(c >= 'A' && c <= 'Z') c |= 0x20;
+      else if(c == '_') c = '-';
+      if(range_length < sizeof(range)) range[range_length++] = c;
+      else too_long = true;
+    }
+    int q = 1000;
+    while(p != end && *p != ',') {
+      if(*p++ != ';') continue;
+      while(p != end && (*p == ' ' || *p == '\t')) ++p;
+      if(end - p >= 2 && (*p|0x20) == 'q' && p[1] == '=') {
+        p += 2;
+        q = parse_qvalue(p, end);
+      }
+    }
+    // (ties go to whichever came first)
+    if(too_long || range_length == 0 || q <= best_q) continue;
+    if(range_length == 1 && range[0] == '*') {
+      best = &default_choice;
+      best_q = q;
+      continue;
+    }
+    const std::string* match;
+    do match = table->Find(range, range_length);
+    while(!match && simple_fallback(range, range_length));
+    if(match) {
+      best = match;
+      best_q = q;
+    }
+  }
+  return best ? *best : default_choice;
+}
@@ -0,0 +1,336 @@
+#include "sn_internal.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A snapshot segment ("<name>.<version>") starts with this, followed by the
+// language code, followed (64-byte aligned) by a copy of a packed language's
+// arena. The control segment ("<name>") holds only the newest version, as a
+// std::atomic<uint64_t>.
+struct SharedLanguageHeader {
+  char magic[8];
+  // must match, or this snapshot came from some other build
+  uint32_t message_size, slot_size;
+  uint32_t message_count, table_shift, hot_table_shift;
+  uint64_t code_offset, code_length;
+  uint64_t arena_offset, arena_size;
+  // (relative to the arena)
+  uint64_t hot_table_offset, table_offset, keys_offset;
+  uint64_t keys, text, code, tables, deduplicated;
+};
+
+static const char SHARED_LANGUAGE_MAGIC[8] = "SNLANG2";
+
+static std::string get_snapshot_name(const std::string& name,
+                                     uint64_t version) {
+  return name + "." + std::to_string(version);
+}
+
+// Maps the control segment. Returns nullptr on failure, with errno set.
+static std::atomic<uint64_t>* map_control(const std::string& name,
+                                          bool create) {
+  int fd = shm_open(name.c_str(), create ? O_RDWR|O_CREAT : O_RDONLY, 0644);
+  if(fd < 0) return nullptr;
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0;
+  if(ok && size_t(st.st_size) < sizeof(std::atomic<uint64_t>)) {
+    if(create) ok = ftruncate(fd, sizeof(std::atomic<uint64_t>)) == 0;
+    else {
+      ok = false;
+      errno = EINVAL;
+    }
+  }
+  void* p = MAP_FAILED;
+  if(ok)
+    p = mmap(nullptr, sizeof(std::atomic<uint64_t>),
+             create ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  int saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  if(p == MAP_FAILED) return nullptr;
+  return static_cast<std::atomic<uint64_t>*>(p);
+}
+
+bool SN::Context::PublishSharedLanguage(const std::string& name) {
+  std::lock_guard<std::mutex> lock(load_mutex);
+  // Only packed languages are position-independent, so pack a copy if need
+  // be. (The copy shares all of its blocks, so this is cheap.)
+  std::shared_ptr<LoadedLanguage> lang = current;
+  if(lang->lazy) {
+    // (other processes would be missing every group that isn't loaded yet)
+    LogMessage(*this) << "SN: Warning: "
+                      << "Couldn't publish shared language " << name
+                      << ": it has lazily loaded key groups (see"
+      " SetKeyFilter), which can't be shared" << std::endl;
+    return false;
+  }
+  if(!lang->packed && lang->message_count != 0) {
+    std::unordered_map<std::string, SubstitutableString> intermap;
+    size_t table_size = size_t(1) << (32 - lang->table_shift);
+    for(size_t n = 0; n < table_size; ++n) {
+      auto& slot = lang->table[n];
+      if(slot.message >= lang->message_count) continue;
+      intermap.emplace(std::string(lang->keys + slot.key_offset,
+                                   slot.key_length),
+                       lang->messages[slot.message]);
+    }
+    lang = std::make_shared<LoadedLanguage>(lang->code,
+                                            lang->source_generation);
+    lang->Build(intermap, true, std::vector<const LoadedLanguage*>(),
+                hot_keys);
+  }
+  const std::string& code = lang->code.GetCode();
+  size_t arena_offset = align_up(sizeof(SharedLanguageHeader) + code.length(),
+                                 64);
+  size_t size = arena_offset + lang->arena_size;
+  auto control = map_control(name, true);
+  if(!control) {
+    LogMessage(*this) << "SN: Warning: "
+                      << "Couldn't publish shared language " << name
+                      << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  uint64_t old_version = control->load(std::memory_order_acquire);
+  uint64_t version = old_version + 1;
+  std::string snapshot_name = get_snapshot_name(name, version);
+  int fd = shm_open(snapshot_name.c_str(), O_RDWR|O_CREAT|O_EXCL, 0644);
+  if(fd < 0 && errno == EEXIST) {
+    // left over from a publisher that died partway through
+    shm_unlink(snapshot_name.c_str());
+    fd = shm_open(snapshot_name.c_str(), O_RDWR|O_CREAT|O_EXCL, 0644);
+  }
+  void* p = MAP_FAILED;
+  if(fd >= 0 && ftruncate(fd, size) == 0)
+    p = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED) {
+    LogMessage(*this) << "SN: Warning: "
+                      << "Couldn't publish shared language " << name
+                      << ": " << strerror(errno) << std::endl;
+    if(fd >= 0) {
+      close(fd);
+      shm_unlink(snapshot_name.c_str());
+    }
+    munmap(control, sizeof(std::atomic<uint64_t>));
+    return false;
+  }
+  close(fd);
+  char* base = static_cast<char*>(p);
+  auto header = reinterpret_cast<SharedLanguageHeader*>(base);
+  memcpy(header->magic, SHARED_LANGUAGE_MAGIC, sizeof(header->magic));
+  header->message_size = sizeof(SubstitutableString);
+  header->slot_size = sizeof(LoadedLanguage::Slot);
+  header->message_count = lang->message_count;
+  header->table_shift = lang->table_shift;
+  header->hot_table_shift = lang->hot_table ? lang->hot_table_shift : 32;
+  header->code_offset = sizeof(SharedLanguageHeader);
+  header->code_length = code.length();
+  header->arena_offset = arena_offset;
+  header->arena_size = lang->arena_size;
+  const char* arena = reinterpret_cast<const char*>(lang->arena.get());
+  header->hot_table_offset = lang->hot_table
+    ? reinterpret_cast<const char*>(lang->hot_table) - arena : 0;
+  header->table_offset = lang->message_count
+    ? reinterpret_cast<const char*>(lang->table) - arena : 0;
+  header->keys_offset = lang->message_count ? lang->keys - arena : 0;
+  header->keys = lang->memory_usage.keys;
+  header->text = lang->memory_usage.text;
+  header->code = lang->memory_usage.code;
+  header->tables = lang->memory_usage.tables;
+  header->deduplicated = lang->memory_usage.deduplicated;
+  memcpy(base + header->code_offset, code.data(), code.length());
+  if(lang->arena_size != 0)
+    memcpy(base + arena_offset, arena, lang->arena_size);
+  munmap(p, size);
+  control->store(version, std::memory_order_release);
+  munmap(control, sizeof(std::atomic<uint64_t>));
+  // Processes that already attached the old version keep their mapping; this
+  // only removes the name.
+  if(old_version != 0)
+    shm_unlink(get_snapshot_name(name, old_version).c_str());
+  return true;
+}
+
+bool SN::Context::AttachSharedLanguage(const std::string& name) {
+  // If a new version is published between reading the version and opening
+  // it, the one we wanted is gone; try again.
+  for(int attempt = 0; attempt < 8; ++attempt) {
+    auto control = map_control(name, false);
+    if(!control) {
+      LogMessage(*this) << "SN: Warning: "
+                        << "Couldn't attach shared language " << name
+                        << ": " << strerror(errno) << std::endl;
+      return false;
+    }
+    uint64_t version = control->load(std::memory_order_acquire);
+    munmap(control, sizeof(std::atomic<uint64_t>));
+    if(version == 0) {
+      LogMessage(*this) << "SN: Warning: "
+                        << "Couldn't attach shared language " << name
+                        << ": nothing has been published" << std::endl;
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock(load_mutex);
+      if(current->external && version == shared_language_version
+         && name == shared_language_name)
+        return true;
+    }
+    int fd = shm_open(get_snapshot_name(name, version).c_str(), O_RDONLY, 0);
+    if(fd < 0 && errno == ENOENT) continue;
+    struct stat st;
+    void* p = MAP_FAILED;
+    size_t size = 0;
+    if(fd >= 0 && fstat(fd, &st) == 0) {
+      size = st.st_size;
+      if(size >= sizeof(SharedLanguageHeader))
+        p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      else
+        errno = EINVAL;
+    }
+    if(fd >= 0) close(fd);
+    if(p == MAP_FAILED) {
+      LogMessage(*this) << "SN: Warning: "
+                        << "Couldn't attach shared language " << name
+                        << ": " << strerror(errno) << std::endl;
+      return false;
+    }
+    std::shared_ptr<const void> mapping(p, [size](const void* p) {
+        munmap(const_cast<void*>(p), size);
+      });
+    const char* base = static_cast<const char*>(p);
+    auto header = reinterpret_cast<const SharedLanguageHeader*>(base);
+    size_t table_size = size_t(1) << (32 - std::min(header->table_shift,
+                                                    32U));
+    size_t hot_table_size = header->hot_table_shift >= 32 ? 0
+      : size_t(1) << (32 - header->hot_table_shift);
+    if(memcmp(header->magic, SHARED_LANGUAGE_MAGIC, sizeof(header->magic))
+       || header->message_size != sizeof(SubstitutableString)
+       || header->slot_size != sizeof(LoadedLanguage::Slot)
+       || header->code_offset + header->code_length > header->arena_offset
+       || header->arena_offset % 64 != 0
+       || header->arena_offset + header->arena_size > size
+       || (header->message_count != 0
+           && (header->table_shift == 0 || header->table_shift > 32
+               || header->hot_table_shift == 0
+               || (hot_table_size != 0
+                   && (header->message_count * sizeof(SubstitutableString)
+                       > header->hot_table_offset
+                       || header->hot_table_offset
+                          + hot_table_size * header->slot_size
+                          > header->table_offset))
+               || header->message_count * sizeof(SubstitutableString)
+                  > header->table_offset
+               || header->table_offset + table_size * header->slot_size
+                  > header->keys_offset
+               || header->keys_offset > header->arena_size))) {
+      LogMessage(*this) << "SN: Warning: "
+                        << "Couldn't attach shared language " << name
+                        << ": it was published by a different build, or is"
+        " damaged" << std::endl;
+      return false;
+    }
+    const char* arena = base + header->arena_offset;
+    // The header only says where things are. Every lookup trusts the slots
+    // and messages too, so check that they stay inside the arena. (Before
+    // making a LoadedLanguage, whose destructor trusts the messages.)
+    auto slots_ok = [&](const LoadedLanguage::Slot* slots, size_t count) {
+      bool got_empty = false;
+      for(size_t n = 0; n < count; ++n) {
+        auto& slot = slots[n];
+        if(slot.message == NO_MESSAGE) {
+          got_empty = true;
+          continue;
+        }
+        if(slot.message >= header->message_count
+           || uint64_t(slot.key_offset) + slot.key_length
+              > header->arena_size - header->keys_offset)
+          return false;
+      }
+      // (or probing for a missing key would never stop)
+      return got_empty;
+    };
+    auto message_ok = [&](const SubstitutableString& message) {
+      if(message.owned) return false;
+      size_t block_size = message.GetBlockSize();
+      if(block_size == 0) return true;
+      int64_t block = reinterpret_cast<const char*>(&message) - arena
+        + int64_t(message.offset);
+      if(block < 0 || block % PACKED_BLOCK_ALIGNMENT != 0
+         || uint64_t(block) + block_size > header->arena_size)
+        return false;
+      auto it = message.GetCode();
+      auto code_end = it + message.code_len;
+      while(it != code_end) {
+        // (see SubstitutableString::Render)
+        if(*it < 0 && *it > -100) {
+          ++it;
+          continue;
+        }
+        size_t words = *it < 0 ? 3 : 2;
+        if(size_t(code_end - it) < words) return false;
+        uint32_t start = uint32_t(it[0]) & 0x7FFFFFFF;
+        if(it[1] < 0 || uint64_t(start) + uint32_t(it[1])
+           > message.storage_len)
+          return false;
+        it += words;
+      }
+      return true;
+    };
+    auto messages = reinterpret_cast<const SubstitutableString*>(arena);
+    bool sound = header->message_count == 0
+      || (slots_ok(reinterpret_cast<const LoadedLanguage::Slot*>
+                   (arena + header->table_offset), table_size)
+          && (hot_table_size == 0
+              || slots_ok(reinterpret_cast<const LoadedLanguage::Slot*>
+                          (arena + header->hot_table_offset),
+                          hot_table_size)));
+    for(uint32_t n = 0; sound && n < header->message_count; ++n)
+      sound = message_ok(messages[n]);
+    if(!sound) {
+      LogMessage(*this) << "SN: Warning: "
+                        << "Couldn't attach shared language " << name
+                        << ": it is damaged" << std::endl;
+      return false;
+    }
+    auto lang = std::make_shared<LoadedLanguage>
+      (LanguageTag::Get(std::string(base + header->code_offset,
+                                    header->code_length)));
+    lang->external = std::move(mapping);
+    lang->arena_size = header->arena_size;
+    lang->packed = true;
+    if(header->message_count != 0) {
+      // (nothing writes to a packed language's messages)
+      lang->messages = reinterpret_cast<SubstitutableString*>
+        (const_cast<char*>(arena));
+      lang->message_count = header->message_count;
+      lang->table = reinterpret_cast<const LoadedLanguage::Slot*>
+        (arena + header->table_offset);
+      lang->table_shift = header->table_shift;
+      if(hot_table_size != 0) {
+        lang->hot_table = reinterpret_cast<const LoadedLanguage::Slot*>
+          (arena + header->hot_table_offset);
+        lang->hot_table_shift = header->hot_table_shift;
+      }
+      lang->keys = arena + header->keys_offset;
+    }
+    lang->memory_usage.keys = header->keys;
+    lang->memory_usage.text = header->text;
+    lang->memory_usage.code = header->code;
+    lang->memory_usage.tables = header->tables;
+    lang->memory_usage.deduplicated = header->deduplicated;
+    // abandon any background load
+    ++language_request_serial;
+    std::lock_guard<std::mutex> lock(load_mutex);
+    SwitchLanguage(std::move(lang));
+    shared_language_name = name;
+    shared_language_version = version;
+    return true;
+  }
+  LogMessage(*this) << "SN: Warning: "
+                    << "Couldn't attach shared language " << name
+                    << ": it kept being replaced" << std::endl;
+  return false;
+}
@@ -0,0 +1,304 @@
+// Differential test of the message compiler (SubstitutableString's
+// constructor). Compiles lots of random messages with it, and with the
+// two-pass compiler it replaced, and checks that both produce the same code
+// and text.
+//
+// sn_core.cc searches messages with AVX2, SSE2, or plain C++, depending on
+// what it is compiled for, so build and run this once for each:
+//
+//   g++ -std=c++14 -O2 -pthread -I.. sn_compile_test.cc ../sn_core.cc -mavx2
+//   g++ -std=c++14 -O2 -pthread -I.. sn_compile_test.cc ../sn_core.cc
+//   (and again with -U__SSE2__ added, for plain C++)
+//
+// Usage: sn_compile_test [messages [seed]]
+// Prints the first message that compiles differently, and exits with status
+// 1, if there is one.
+//
+// Before that, it also checks that LoadedLanguage::Build stores a hot
+// message and a cold one with the same text only once, and counts them that
+// way in GetMemoryUsage.
+
+#include "sn.hh"
+
+#include <map>
+#include <random>
+
+using namespace SN;
+
+// The compiler as it was before it became a single pass, except for two
+// fixes, which the new one shares: a trailing '$' used to read past the end
+// of the message, and "$(" followed by anything but a key name or ')' used to
+// loop forever. Both now give a literal '$', as the neighbouring cases do.
+static void reference_compile(const std::string& raw,
+                              std::vector<int32_t>& code,
+                              std::string& storage) {
+  code.clear();
+  storage.clear();
+  auto raw_it = raw.cbegin();
+  auto raw_end = raw.cend();
+  int out_len = 0;
+  while(raw_it != raw_end) {
+    switch(*raw_it) {
+    case '\\':
+      ++raw_it;
+      if(raw_it != raw_end) {
+        if(*raw_it > ' ' && *raw_it < 127)
+          ++out_len;
+        ++raw_it;
+      }
+      break;
+    case '$':
+      ++raw_it;
+      if(raw_it != raw_end && *raw_it >= '1' && *raw_it <= '9') {
+        ++raw_it;
+        if(raw_it != raw_end && *raw_it >= '0' && *raw_it <= '9') {
+          ++raw_it;
+        }
+        break;
+      }
+      else if(raw_it != raw_end && *raw_it == '(') { // (fixed)
+        auto old_it = raw_it;
+        int old_out_len = out_len;
+        ++raw_it;
+        bool fall_through = true;
+        while(raw_it != raw_end) {
+          if((*raw_it >= 'A' && *raw_it <= 'Z')
+             || (*raw_it >= 'a' && *raw_it <= 'z')
+             || (*raw_it >= '0' && *raw_it <= '9')
+             || *raw_it == '_') {
+            ++raw_it;
+            ++out_len;
+          }
+          else if(*raw_it == ')') {
+            ++raw_it;
+            fall_through = false;
+            break;
+          }
+          else break; // (fixed)
+        }
+        if(!fall_through) break;
+        // falling through
+        raw_it = old_it;
+        out_len = old_out_len;
+      }
+      ++out_len;
+      break;
+    default:
+      ++raw_it;
+      ++out_len;
+      break;
+    }
+  }
+  storage.reserve(out_len);
+  raw_it = raw.cbegin();
+  int out_start = 0;
+  while(raw_it != raw_end) {
+    switch(*raw_it) {
+    case '\\':
+      ++raw_it;
+      if(raw_it != raw_end) {
+        if(*raw_it > ' ' && *raw_it < 127)
+          storage.push_back(*raw_it);
+        ++raw_it;
+      }
+      break;
+    case '$':
+      ++raw_it;
+      if(raw_it != raw_end) {
+        if(*raw_it >= '1' && *raw_it <= '9') {
+          int cur_len = storage.length();
+          if(out_start != cur_len) {
+            code.push_back(out_start);
+            code.push_back(cur_len - out_start);
+            out_start = cur_len;
+          }
+          int ref = *raw_it-'0';
+          ++raw_it;
+          if(raw_it != raw_end && *raw_it >= '0' && *raw_it <= '9') {
+            ref = ref * 10 + (*raw_it-'0');
+            ++raw_it;
+          }
+          code.push_back(-ref);
+          break;
+        }
+        else if(*raw_it == '(') {
+          auto old_it = raw_it;
+          auto old_storage_size = storage.size();
+          int old_len = storage.length();
+          ++raw_it;
+          bool fall_through = true;
+          while(raw_it != raw_end) {
+            if((*raw_it >= 'A' && *raw_it <= 'Z')
+               || (*raw_it >= 'a' && *raw_it <= 'z')
+               || (*raw_it >= '0' && *raw_it <= '9')
+               || *raw_it == '_') {
+              storage.push_back(*raw_it++);
+            }
+            else if(*raw_it == ')') {
+              ++raw_it;
+              int cur_len = storage.length();
+              if(cur_len == old_len) break; // empty, fall through
+              if(out_start != old_len) {
+                code.push_back(out_start);
+                code.push_back(old_len - out_start);
+              }
+              code.push_back(old_len | -2147483648);
+              code.push_back(cur_len - old_len);
+              code.push_back(static_cast<int32_t>
+                             (Key::CalculateHash(storage.cbegin()+old_len,
+                                                 storage.cbegin()+cur_len)));
+              out_start = cur_len;
+              fall_through = false;
+              break;
+            }
+            else break; // (fixed)
+          }
+          if(!fall_through) break;
+          // falling through
+          raw_it = old_it;
+          storage.resize(old_storage_size);
+        }
+      }
+      storage.push_back('$');
+      if(raw_it == raw_end) break; // (fixed)
+      // fallthrough
+    default:
+      storage.push_back(*raw_it);
+      ++raw_it;
+      break;
+    }
+  }
+  int cur_len = storage.length();
+  if(out_start != cur_len && !code.empty()) {
+    code.push_back(out_start);
+    code.push_back(cur_len - out_start);
+  }
+}
+
+namespace SN {
+  struct CompileTest {
+    static void Compile(const std::string& raw, std::vector<int32_t>& code,
+                        std::string& storage) {
+      SubstitutableString compiled(raw);
+      code.clear();
+      storage.clear();
+      if(compiled.code_len != 0)
+        code.assign(compiled.GetCode(),
+                    compiled.GetCode() + compiled.code_len);
+      if(compiled.storage_len != 0)
+        storage.assign(compiled.GetStorage(), compiled.storage_len);
+    }
+  };
+}
+
+static bool check(const std::string& raw) {
+  std::vector<int32_t> expected_code, code;
+  std::string expected_storage, storage;
+  reference_compile(raw, expected_code, expected_storage);
+  CompileTest::Compile(raw, code, storage);
+  if(code == expected_code && storage == expected_storage) return true;
+  std::cout << "Compiled differently: \"";
+  for(char c : raw) {
+    if(c == '\n') std::cout << "\\n";
+    else if(c == '"' || c == '\\') std::cout << '\\' << c;
+    else std::cout << c;
+  }
+  std::cout << "\"" << std::endl;
+  return false;
+}
+
+// serves cats from strings
+class StringCatSource : public CatSource {
+  std::map<std::string, std::string> cats;
+public:
+  StringCatSource(std::map<std::string, std::string> cats)
+    : cats(std::move(cats)) {}
+  void GetAvailableCats(std::function<void(std::string)> func) override {
+    for(auto& pair : cats) func(pair.first);
+  }
+  std::unique_ptr<std::istream> OpenCat(const std::string& cat) override {
+    auto it = cats.find(cat);
+    if(it == cats.end()) return nullptr;
+    return std::make_unique<std::istringstream>(it->second);
+  }
+};
+
+static const char SHARED_TEXT[] = "Text that every language has.";
+static const char OTHER_TEXT[] = "Text that only one cold message has.";
+
+// Loads fr, where HOT and COLD are both SHARED_TEXT and OTHER is OTHER_TEXT.
+// With a donor, de (which has both texts) is current while fr is built.
+static MemoryUsage load_fr(bool with_donor) {
+  std::ostringstream log;
+  Context sn(log);
+  std::map<std::string, std::string> cats;
+  cats["de"] = std::string("Language-Code: de\nLanguage-Name: Deutsch\n\n")
+    + "A\n" + SHARED_TEXT + "\n.\nB\n" + OTHER_TEXT + "\n.\n";
+  cats["fr"] = std::string("Language-Code: fr\nLanguage-Name: Fran\xC3\xA7"
+                           "ais\n\n")
+    + "HOT\n" + SHARED_TEXT + "\n.\nCOLD\n" + SHARED_TEXT + "\n.\n"
+    + "OTHER\n" + OTHER_TEXT + "\n.\n";
+  sn.AddCatSource(std::make_unique<StringCatSource>(std::move(cats)));
+  sn.SetLanguageCacheBudget(1 << 20);
+  std::istringstream profile("HOT\n");
+  sn.LoadKeyProfile(profile);
+  if(with_donor) sn.SetLanguage("de");
+  sn.SetLanguage("fr");
+  if(sn.Get("HOT"_Key) != SHARED_TEXT || sn.Get("COLD"_Key) != SHARED_TEXT
+     || sn.Get("OTHER"_Key) != OTHER_TEXT) {
+    std::cout << "Deduplicated messages have the wrong text" << std::endl;
+    exit(1);
+  }
+  return sn.GetMemoryUsage();
+}
+
+static bool check_dedup() {
+  size_t shared_length = strlen(SHARED_TEXT);
+  size_t other_length = strlen(OTHER_TEXT);
+  // COLD shares HOT's packed block
+  MemoryUsage alone = load_fr(false);
+  if(alone.text != shared_length + other_length
+     || alone.deduplicated != shared_length) {
+    std::cout << "Without a donor: " << alone.text << " bytes of text and "
+              << alone.deduplicated << " deduplicated" << std::endl;
+    return false;
+  }
+  // HOT is packed, so it can't share de's block. COLD still shares HOT's,
+  // and OTHER shares de's, which counts against de alone.
+  MemoryUsage donated = load_fr(true);
+  if(donated.text != shared_length
+     || donated.deduplicated != shared_length + other_length
+     || donated.tables >= alone.tables) {
+    std::cout << "With a donor: " << donated.text << " bytes of text, "
+              << donated.deduplicated << " deduplicated, and "
+              << donated.tables << " of tables (" << alone.tables
+              << " without)" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if(!check_dedup()) return 1;
+  long messages = argc > 1 ? atol(argv[1]) : 500000;
+  std::mt19937 rng(argc > 2 ? atol(argv[2]) : 35);
+  // the cases that used to be broken, and their neighbours
+  for(auto raw : {"", "$", "\\", "abc$", "abc\\", "$(", "x$(", "$()", "$(_)",
+        "$(a-b)", "$(a b)", "$(a)$", "$1$", "$12$(", "\\$(a)"}) {
+    if(!check(raw)) return 1;
+  }
+  // Mostly letters, with plenty of the characters the compiler cares about.
+  // Every tenth message is long, to cover the vectorized search.
+  static const char SPECIAL[] = "\\$()19a0_ Z\n\x80-x";
+  for(long n = 0; n < messages; ++n) {
+    std::string raw;
+    size_t length = rng() % (n % 10 == 0 ? 200 : 24);
+    for(size_t i = 0; i < length; ++i) {
+      if(rng() % 4 == 0) raw.push_back(SPECIAL[rng() % (sizeof(SPECIAL)-1)]);
+      else raw.push_back('a' + rng() % 26);
+    }
+    if(!check(raw)) return 1;
+  }
+  std::cout << messages << " random messages compiled the same" << std::endl;
+  return 0;
+}